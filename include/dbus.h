@@ -40,6 +40,7 @@ extern "C" {
 #define CONNMAN_MANAGER_PATH		"/"
 
 #define CONNMAN_CLOCK_INTERFACE		CONNMAN_SERVICE ".Clock"
+#define CONNMAN_DNSPROXY_INTERFACE	CONNMAN_SERVICE ".DNSProxy"
 #define CONNMAN_TASK_INTERFACE		CONNMAN_SERVICE ".Task"
 #define CONNMAN_SERVICE_INTERFACE	CONNMAN_SERVICE ".Service"
 #define CONNMAN_PROVIDER_INTERFACE	CONNMAN_SERVICE ".Provider"
@@ -22,14 +22,28 @@
 #ifndef __CONNMAN_STORAGE_H
 #define __CONNMAN_STORAGE_H
 
+#include <stdbool.h>
+
 #include <glib.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct connman_storage_entry {
+	char *identifier;
+	char *name;
+	char *ssid;
+	int frequency;
+	bool favorite;
+	bool autoconnect;
+	bool hidden;
+	GTimeVal modified;
+};
+
 gchar **connman_storage_get_services();
 GKeyFile *connman_storage_load_service(const char *service_id);
+GList *connman_storage_get_favorites(const char *type);
 
 #ifdef __cplusplus
 }
@@ -1037,53 +1037,29 @@ static int add_scan_param(gchar *hex_ssid, char *raw_ssid, int ssid_len,
 static int get_hidden_connections(GSupplicantScanParams *scan_data)
 {
 	struct connman_config_entry **entries;
-	GKeyFile *keyfile;
-	gchar **services;
-	char *ssid, *name;
+	struct connman_storage_entry *entry;
+	GList *favorites, *list;
+	char *ssid;
 	int i, ret;
-	bool value;
 	int num_ssids = 0, add_param_failed = 0;
 
-	services = connman_storage_get_services();
-	for (i = 0; services && services[i]; i++) {
-		if (strncmp(services[i], "wifi_", 5) != 0)
-			continue;
-
-		keyfile = connman_storage_load_service(services[i]);
-		if (!keyfile)
-			continue;
-
-		value = g_key_file_get_boolean(keyfile,
-					services[i], "Hidden", NULL);
-		if (!value) {
-			g_key_file_free(keyfile);
-			continue;
-		}
+	favorites = connman_storage_get_favorites("wifi");
+	for (list = favorites; list; list = list->next) {
+		entry = list->data;
 
-		value = g_key_file_get_boolean(keyfile,
-					services[i], "Favorite", NULL);
-		if (!value) {
-			g_key_file_free(keyfile);
+		if (!entry->hidden)
 			continue;
-		}
-
-		ssid = g_key_file_get_string(keyfile,
-					services[i], "SSID", NULL);
 
-		name = g_key_file_get_string(keyfile, services[i], "Name",
-								NULL);
-
-		ret = add_scan_param(ssid, NULL, 0, 0, scan_data, 0, name);
+		ret = add_scan_param(entry->ssid, NULL, 0, 0, scan_data, 0,
+								entry->name);
 		if (ret < 0)
 			add_param_failed++;
 		else if (ret > 0)
 			num_ssids++;
-
-		g_free(ssid);
-		g_free(name);
-		g_key_file_free(keyfile);
 	}
 
+	g_list_free(favorites);
+
 	/*
 	 * Check if there are any hidden AP that needs to be provisioned.
 	 */
@@ -1118,8 +1094,6 @@ static int get_hidden_connections(GSupplicantScanParams *scan_data)
 		DBG("Unable to scan %d out of %d SSIDs",
 					add_param_failed, num_ssids);
 
-	g_strfreev(services);
-
 	return num_ssids;
 }
 
@@ -1557,135 +1531,34 @@ static int wifi_disable(struct connman_device *device)
 	return -EINPROGRESS;
 }
 
-struct last_connected {
-	GTimeVal modified;
-	gchar *ssid;
-	int freq;
-};
-
-static gint sort_entry(gconstpointer a, gconstpointer b, gpointer user_data)
-{
-	GTimeVal *aval = (GTimeVal *)a;
-	GTimeVal *bval = (GTimeVal *)b;
-
-	/* Note that the sort order is descending */
-	if (aval->tv_sec < bval->tv_sec)
-		return 1;
-
-	if (aval->tv_sec > bval->tv_sec)
-		return -1;
-
-	return 0;
-}
-
-static void free_entry(gpointer data)
-{
-	struct last_connected *entry = data;
-
-	g_free(entry->ssid);
-	g_free(entry);
-}
-
 static int get_latest_connections(int max_ssids,
 				GSupplicantScanParams *scan_data)
 {
-	GSequenceIter *iter;
-	GSequence *latest_list;
-	struct last_connected *entry;
-	GKeyFile *keyfile;
-	GTimeVal modified;
-	gchar **services;
-	gchar *str;
-	char *ssid;
-	int i, freq;
+	struct connman_storage_entry *entry;
+	GList *favorites, *list;
 	int num_ssids = 0;
 
-	latest_list = g_sequence_new(free_entry);
-	if (!latest_list)
-		return -ENOMEM;
+	/* Ordered by last use, most recent first */
+	favorites = connman_storage_get_favorites("wifi");
 
-	services = connman_storage_get_services();
-	for (i = 0; services && services[i]; i++) {
-		if (strncmp(services[i], "wifi_", 5) != 0)
-			continue;
+	for (list = favorites; list && num_ssids < max_ssids;
+						list = list->next) {
+		entry = list->data;
 
-		keyfile = connman_storage_load_service(services[i]);
-		if (!keyfile)
+		if (!entry->autoconnect || entry->modified.tv_sec == 0 ||
+				!entry->frequency)
 			continue;
 
-		str = g_key_file_get_string(keyfile,
-					services[i], "Favorite", NULL);
-		if (!str || g_strcmp0(str, "true")) {
-			g_free(str);
-			g_key_file_free(keyfile);
-			continue;
-		}
-		g_free(str);
-
-		str = g_key_file_get_string(keyfile,
-					services[i], "AutoConnect", NULL);
-		if (!str || g_strcmp0(str, "true")) {
-			g_free(str);
-			g_key_file_free(keyfile);
-			continue;
-		}
-		g_free(str);
-
-		str = g_key_file_get_string(keyfile,
-					services[i], "Modified", NULL);
-		if (!str) {
-			g_key_file_free(keyfile);
-			continue;
-		}
-		g_time_val_from_iso8601(str, &modified);
-		g_free(str);
-
-		ssid = g_key_file_get_string(keyfile,
-					services[i], "SSID", NULL);
-
-		freq = g_key_file_get_integer(keyfile, services[i],
-					"Frequency", NULL);
-		if (freq) {
-			entry = g_try_new(struct last_connected, 1);
-			if (!entry) {
-				g_sequence_free(latest_list);
-				g_key_file_free(keyfile);
-				g_free(ssid);
-				return -ENOMEM;
-			}
-
-			entry->ssid = ssid;
-			entry->modified = modified;
-			entry->freq = freq;
+		DBG("ssid %s freq %d modified %lu", entry->ssid,
+				entry->frequency, entry->modified.tv_sec);
 
-			g_sequence_insert_sorted(latest_list, entry,
-						sort_entry, NULL);
-			num_ssids++;
-		} else
-			g_free(ssid);
-
-		g_key_file_free(keyfile);
+		add_scan_param(entry->ssid, NULL, 0, entry->frequency,
+					scan_data, max_ssids, entry->ssid);
+		num_ssids++;
 	}
 
-	g_strfreev(services);
-
-	num_ssids = num_ssids > max_ssids ? max_ssids : num_ssids;
-
-	iter = g_sequence_get_begin_iter(latest_list);
-
-	for (i = 0; i < num_ssids; i++) {
-		entry = g_sequence_get(iter);
-
-		DBG("ssid %s freq %d modified %lu", entry->ssid, entry->freq,
-						entry->modified.tv_sec);
-
-		add_scan_param(entry->ssid, NULL, 0, entry->freq, scan_data,
-						max_ssids, entry->ssid);
-
-		iter = g_sequence_iter_next(iter);
-	}
+	g_list_free(favorites);
 
-	g_sequence_free(latest_list);
 	return num_ssids;
 }
 
@@ -223,6 +223,9 @@ static void unregister_service(gpointer data)
 			}
 		}
 
+		/* a pending write would create the settings again */
+		__connman_service_save_cancel(service);
+
 		if (!__connman_storage_remove_service(service_id))
 			DBG("Could not remove all files for service %s",
 								service_id);
@@ -127,6 +127,17 @@ int __connman_counter_unregister(const char *owner, const char *path)
 	return 0;
 }
 
+unsigned int __connman_counter_get_interval(const char *path)
+{
+	struct connman_counter *counter;
+
+	counter = g_hash_table_lookup(counter_table, path);
+	if (!counter)
+		return 0;
+
+	return counter->interval;
+}
+
 void __connman_counter_send_usage(const char *path,
 					DBusMessage *message)
 {
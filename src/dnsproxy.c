@@ -23,15 +23,19 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <resolv.h>
@@ -39,6 +43,8 @@
 
 #include <glib.h>
 
+#include <gdbus.h>
+
 #include "connman.h"
 
 #define debug(fmt...) do { } while (0)
@@ -98,8 +104,19 @@ struct server_data {
 	bool enabled;
 	bool connected;
 	struct partial_reply *incoming_reply;
+	unsigned int srtt; /* smoothed round trip time in ms */
+	unsigned int queries;
+	unsigned int replies;
+	GSList *pending; /* ids of the requests sent over TCP */
 };
 
+/*
+ * Typical queries and names fit into buffers that are part of the
+ * request itself, so no separate allocations are needed for them.
+ */
+#define REQUEST_INLINE_LEN 512
+#define NAME_INLINE_LEN 256
+
 struct request_data {
 	union {
 		struct sockaddr_in6 __sin6; /* Only for the length */
@@ -112,7 +129,10 @@ struct request_data {
 	guint16 srcid;
 	guint16 dstid;
 	guint16 altid;
-	guint timeout;
+	guint16 udp_size; /* largest UDP reply the client accepts */
+	GList *link; /* in request_queue */
+	GList *timeout_link; /* in request_wheel */
+	unsigned int timeout_slot;
 	guint watch;
 	guint numserv;
 	guint numresp;
@@ -123,6 +143,16 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	bool append_domain;
+	bool prefetch; /* internal request refreshing a cache entry */
+	bool failover; /* not all servers have been asked yet */
+	bool retransmit;
+	GSList *raced; /* servers asked before the failover */
+	uint64_t sent; /* monotonic time in ms */
+	GBytes *key; /* in inflight_table while leading */
+	GSList *waiters; /* coalesced requests for the same question */
+	struct client_data *client; /* if the client is limited */
+	unsigned char request_buf[REQUEST_INLINE_LEN];
+	char name_buf[NAME_INLINE_LEN];
 };
 
 struct listener_data {
@@ -153,23 +183,37 @@ struct tcp_partial_client_data {
 	guint timeout;
 };
 
+/* most answers fit into the cached data itself */
+#define CACHE_DATA_INLINE_LEN 192
+#define CACHE_DATA_INLINE_TTLS 8
+
 struct cache_data {
 	time_t inserted;
 	time_t valid_until;
 	time_t cache_until;
 	int timeout;
 	uint16_t type;
+	uint16_t class;
+	uint8_t rcode;
 	uint16_t answers;
+	uint16_t authority; /* SOA record of a negative answer */
+	bool prefetching;
 	unsigned int data_len;
 	unsigned char *data; /* contains DNS header + body */
+	unsigned int ttl_count;
+	uint16_t *ttl_offsets; /* of the record TTLs in data */
+	unsigned char data_buf[CACHE_DATA_INLINE_LEN];
+	uint16_t ttl_buf[CACHE_DATA_INLINE_TTLS];
 };
 
 struct cache_entry {
 	char *key;
 	bool want_refresh;
 	int hits;
-	struct cache_data *ipv4;
-	struct cache_data *ipv6;
+	unsigned int size;
+	GList *lru_link;
+	GSList *records; /* struct cache_data, one per type and class */
+	GSList *stale; /* expired struct cache_data kept for serve-stale */
 };
 
 struct domain_question {
@@ -189,6 +233,16 @@ struct domain_rr {
  */
 #define TCP_MAX_BUF_LEN 4096
 
+/*
+ * Size of UDP replies. Clients that do not announce an EDNS0 buffer
+ * size get at most 512 bytes, the others at most what they announce
+ * but not more than max_udp_size.
+ */
+#define DNS_UDP_SIZE 512
+#define DNS_MAX_UDP_SIZE 65535
+static unsigned int max_udp_size;
+static unsigned char *udp_reply_buf;
+
 /*
  * We limit how long the cached DNS entry stays in the cache.
  * By default the TTL (time-to-live) of the DNS response is used
@@ -201,19 +255,141 @@ struct domain_rr {
 #define MIN_CACHE_TTL (30)
 
 /*
- * We limit the cache size to some sane value so that cached data does
- * not occupy too much memory. Each cached entry occupies on average
- * about 100 bytes memory (depending on DNS name length).
- * Example: caching www.connman.net uses 97 bytes memory.
- * The value is the max amount of cached DNS responses (count).
+ * The cache is limited by the amount of memory its entries use
+ * rather than by their count. The limit is set by DnsProxyCacheSize
+ * in main.conf (in KiB), zero disables caching. When the limit is
+ * reached the coldest entries are evicted to make room for new ones.
  */
-#define MAX_CACHE_SIZE 256
-
 static int cache_size;
+static unsigned int cache_max_mem;
+static unsigned int cache_mem;
+static GQueue cache_lru;
+
+/*
+ * Negative answers (NXDOMAIN and NODATA) are cached together with
+ * the SOA record from the authority section as described in RFC 2308.
+ * Their lifetime is capped by DnsProxyNegativeCacheTTL, zero disables
+ * negative caching.
+ */
+static unsigned int negative_max_ttl;
+
+/*
+ * Entries used at least prefetch_threshold times are resolved again
+ * when they are used after PREFETCH_PERCENT of their lifetime, so
+ * that popular names are refreshed before they expire. The cached
+ * answer is served until the new one arrives.
+ */
+#define PREFETCH_PERCENT 90
+static unsigned int prefetch_threshold;
+
+/*
+ * When serve-stale is enabled (RFC 8767), expired data is kept for
+ * up to stale_max_time seconds after it has expired. It is only used
+ * when none of the servers answered a request in time, and is sent
+ * with a short TTL so that clients ask again soon.
+ */
+#define STALE_ANSWER_TTL 30
+static unsigned int stale_max_time;
+
+/*
+ * Counters exported by GetStatistics. They are plain increments on
+ * the paths they count, so they can be left enabled.
+ */
+static struct {
+	unsigned int queries;
+	unsigned int tcp_queries;
+	unsigned int cache_hits;
+	unsigned int cache_misses;
+	unsigned int cache_evictions;
+	unsigned int negative_inserts;
+	unsigned int negative_hits;
+	unsigned int stale_hits;
+	unsigned int coalesced_queries;
+	unsigned int upstream_queries;
+	unsigned int upstream_timeouts;
+	unsigned int truncated_replies;
+	unsigned int rate_limited;
+	unsigned int pending_limited;
+	unsigned int local_answers;
+} proxy_stats;
+
 static GHashTable *cache;
 static int cache_refcount;
 static GSList *server_list = NULL;
-static GSList *request_list = NULL;
+
+/*
+ * The requests waiting for an answer from the servers are kept in
+ * request_queue, and indexed by their upstream ids (dstid and altid)
+ * in request_table so that a reply finds its request directly.
+ */
+static GQueue request_queue;
+static GHashTable *request_table = NULL;
+
+/*
+ * Request timeouts are kept in a timer wheel with one second slots,
+ * driven by a single timer that only runs while there are requests
+ * waiting. This keeps the cost of arming, cancelling and expiring a
+ * timeout constant however many requests are outstanding.
+ */
+#define REQUEST_WHEEL_SLOTS 64
+static GQueue request_wheel[REQUEST_WHEEL_SLOTS];
+static unsigned int request_wheel_pos;
+static unsigned int request_wheel_count;
+static guint request_wheel_timer;
+
+/*
+ * Servers are ranked by the expected time to get an answer from
+ * them, computed from their smoothed round trip time and the share
+ * of queries left unanswered, which are counted as taking
+ * FAILURE_PENALTY ms. A query is first sent to the race_servers best
+ * ones (zero means all) and the first valid answer wins. If none
+ * of them answers within FAILOVER_TIMEOUT seconds, it is sent to
+ * all servers.
+ */
+#define FAILURE_PENALTY 2000
+#define FAILOVER_TIMEOUT 2
+#define SERVER_STATS_MAX 128
+static unsigned int race_servers;
+
+/*
+ * TCP connections to the servers are kept open and reused for further
+ * queries, several of which can be outstanding at the same time
+ * (RFC 7766). A connection is closed when it has been idle for
+ * tcp_idle_time seconds, or after each reply if that is zero.
+ */
+#define TCP_CONNECT_TIMEOUT 30
+static unsigned int tcp_idle_time;
+
+/* connections to the servers that are still being set up */
+static GSList *tcp_connect_list;
+
+static void request_timer_start(struct request_data *req,
+						unsigned int seconds);
+static void tcp_server_touch(struct server_data *server);
+/*
+ * A UDP listener reads up to UDP_BATCH_SIZE queries per wakeup with
+ * one recvmmsg() call. The replies served from the cache while the
+ * batch is handled are collected in reply_batch and sent with one
+ * sendmmsg() call at the end. Each queued reply is copied into its own
+ * max_udp_size slot of udp_batch_buf.
+ */
+#define UDP_BATCH_SIZE 16
+
+struct udp_batch {
+	int sk;
+	unsigned int count;
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	struct sockaddr_in6 addr[UDP_BATCH_SIZE];
+};
+
+static struct udp_batch *reply_batch;
+static unsigned char *udp_batch_buf;
+
+static int ns_resolv(struct server_data *server, struct request_data *req,
+				gpointer request, gpointer name);
+static bool resolv(struct request_data *req,
+				gpointer request, gpointer name);
 static GHashTable *listener_table = NULL;
 static time_t next_refresh;
 static GHashTable *partial_tcp_req_table;
@@ -223,7 +399,11 @@ static guint16 get_id(void)
 {
 	uint64_t rand;
 
-	__connman_util_get_random(&rand);
+	/* do not reuse an id that a pending request is waiting for */
+	do {
+		__connman_util_get_random(&rand);
+	} while (request_table && g_hash_table_lookup(request_table,
+					GUINT_TO_POINTER((guint16) rand)));
 
 	return rand;
 }
@@ -264,18 +444,223 @@ static time_t round_down_ttl(time_t end_time, int ttl)
 	return end_time;
 }
 
-static struct request_data *find_request(guint16 id)
+static uint64_t monotonic_ms(void)
 {
-	GSList *list;
+	struct timespec ts;
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Requests and cached data are allocated from pools of fixed size
+ * objects. The objects are carved out of slabs, and freed objects are
+ * kept for reuse instead of being returned to the heap, so the memory
+ * used stays at the peak load instead of fragmenting the heap.
+ */
+#define POOL_SLAB_OBJECTS 32
+
+struct object_pool {
+	size_t size;
+	void *free_list;
+	GSList *slabs;
+	unsigned int used;
+};
+
+static struct object_pool request_pool = {
+	.size = sizeof(struct request_data),
+};
+
+static struct object_pool cache_entry_pool = {
+	.size = sizeof(struct cache_entry),
+};
+
+static struct object_pool cache_data_pool = {
+	.size = sizeof(struct cache_data),
+};
+
+static size_t pool_object_size(struct object_pool *pool)
+{
+	/* keep the objects in a slab aligned for any type */
+	return (pool->size + sizeof(void *) * 2 - 1) &
+					~(sizeof(void *) * 2 - 1);
+}
+
+static void *pool_alloc(struct object_pool *pool)
+{
+	size_t size = pool_object_size(pool);
+	char *obj;
+
+	if (!pool->free_list) {
+		char *slab;
+		int i;
+
+		slab = g_try_malloc(size * POOL_SLAB_OBJECTS);
+		if (!slab)
+			return NULL;
+
+		pool->slabs = g_slist_prepend(pool->slabs, slab);
 
-		if (req->dstid == id || req->altid == id)
-			return req;
+		for (i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+			obj = slab + i * size;
+			*(void **) obj = pool->free_list;
+			pool->free_list = obj;
+		}
 	}
 
-	return NULL;
+	obj = pool->free_list;
+	pool->free_list = *(void **) obj;
+	pool->used++;
+
+	memset(obj, 0, pool->size);
+
+	return obj;
+}
+
+static void pool_free(struct object_pool *pool, void *obj)
+{
+	if (!obj)
+		return;
+
+	*(void **) obj = pool->free_list;
+	pool->free_list = obj;
+	pool->used--;
+}
+
+static size_t pool_memory(struct object_pool *pool)
+{
+	return g_slist_length(pool->slabs) * POOL_SLAB_OBJECTS *
+						pool_object_size(pool);
+}
+
+static void pool_destroy(struct object_pool *pool)
+{
+	g_slist_free_full(pool->slabs, g_free);
+	pool->slabs = NULL;
+	pool->free_list = NULL;
+	pool->used = 0;
+}
+
+static unsigned int server_score(const struct server_data *server)
+{
+	unsigned int lost = 0;
+
+	/* servers we know nothing about are tried first */
+	if (server->queries == 0)
+		return 0;
+
+	if (server->queries > server->replies)
+		lost = server->queries - server->replies;
+
+	return (server->srtt * server->replies + FAILURE_PENALTY * lost) /
+							server->queries;
+}
+
+static gint server_compare(gconstpointer a, gconstpointer b)
+{
+	return (gint) server_score(a) - (gint) server_score(b);
+}
+
+static void server_query_sent(struct server_data *server)
+{
+	/* age the counters so that the score follows recent behaviour */
+	if (server->queries >= SERVER_STATS_MAX) {
+		server->queries /= 2;
+		server->replies /= 2;
+	}
+
+	server->queries++;
+
+	proxy_stats.upstream_queries++;
+}
+
+static void server_reply_received(struct server_data *server,
+					struct request_data *req)
+{
+	unsigned int rtt;
+
+	if (server->replies < server->queries)
+		server->replies++;
+
+	/* a retransmitted request does not give a reliable sample */
+	if (!req || req->retransmit || req->sent == 0)
+		return;
+
+	rtt = monotonic_ms() - req->sent;
+
+	if (server->srtt == 0)
+		server->srtt = rtt ? rtt : 1;
+	else
+		server->srtt = (7 * server->srtt + rtt) / 8;
+}
+
+static struct request_data *find_request(guint16 id)
+{
+	if (!request_table)
+		return NULL;
+
+	return g_hash_table_lookup(request_table, GUINT_TO_POINTER(id));
+}
+
+static void request_add(struct request_data *req)
+{
+	g_queue_push_tail(&request_queue, req);
+	req->link = g_queue_peek_tail_link(&request_queue);
+
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->dstid), req);
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->altid), req);
+}
+
+/*
+ * Identical UDP queries that arrive while one is already being
+ * resolved are not forwarded again. They are attached to the pending
+ * request, keyed by the whole query except its id, and answered
+ * together with it.
+ */
+static GHashTable *inflight_table;
+
+static void request_inflight_remove(struct request_data *req)
+{
+	if (!req->key)
+		return;
+
+	if (inflight_table &&
+			g_hash_table_lookup(inflight_table, req->key) == req)
+		g_hash_table_remove(inflight_table, req->key);
+
+	g_bytes_unref(req->key);
+	req->key = NULL;
+}
+
+static void request_remove(struct request_data *req)
+{
+	request_inflight_remove(req);
+
+	if (!req->link)
+		return;
+
+	g_queue_delete_link(&request_queue, req->link);
+	req->link = NULL;
+
+	if (find_request(req->dstid) == req)
+		g_hash_table_remove(request_table,
+					GUINT_TO_POINTER(req->dstid));
+
+	if (find_request(req->altid) == req)
+		g_hash_table_remove(request_table,
+					GUINT_TO_POINTER(req->altid));
+}
+
+static void request_timer_stop(struct request_data *req)
+{
+	if (!req->timeout_link)
+		return;
+
+	g_queue_delete_link(&request_wheel[req->timeout_slot],
+						req->timeout_link);
+	req->timeout_link = NULL;
+	request_wheel_count--;
 }
 
 static struct server_data *find_server(int index,
@@ -307,6 +692,51 @@ static struct server_data *find_server(int index,
 	return NULL;
 }
 
+static struct server_data *find_connecting_server(int index,
+							const char *server)
+{
+	GSList *list;
+
+	for (list = tcp_connect_list; list; list = list->next) {
+		struct server_data *data = list->data;
+
+		if (data->index == index && g_str_equal(data->server, server))
+			return data;
+	}
+
+	return NULL;
+}
+
+static struct cache_data *cache_entry_get(struct cache_entry *entry,
+						uint16_t type, uint16_t class)
+{
+	GSList *list;
+
+	for (list = entry->records; list; list = list->next) {
+		struct cache_data *data = list->data;
+
+		if (data->type == type && data->class == class)
+			return data;
+	}
+
+	return NULL;
+}
+
+static struct cache_data *cache_entry_get_stale(struct cache_entry *entry,
+						uint16_t type, uint16_t class)
+{
+	GSList *list;
+
+	for (list = entry->stale; list; list = list->next) {
+		struct cache_data *data = list->data;
+
+		if (data->type == type && data->class == class)
+			return data;
+	}
+
+	return NULL;
+}
+
 /* we can keep using the same resolve's */
 static GResolv *ipv4_resolve;
 static GResolv *ipv6_resolve;
@@ -334,14 +764,14 @@ static void refresh_dns_entry(struct cache_entry *entry, char *name)
 		g_resolv_add_nameserver(ipv6_resolve, "::1", 53, 0);
 	}
 
-	if (!entry->ipv4) {
+	if (!cache_entry_get(entry, ns_t_a, ns_c_in)) {
 		debug("Refreshing A record for %s", name);
 		g_resolv_lookup_hostname(ipv4_resolve, name,
 					dummy_resolve_func, NULL);
 		age = 4;
 	}
 
-	if (!entry->ipv6) {
+	if (!cache_entry_get(entry, ns_t_aaaa, ns_c_in)) {
 		debug("Refreshing AAAA record for %s", name);
 		g_resolv_lookup_hostname(ipv6_resolve, name,
 					dummy_resolve_func, NULL);
@@ -360,62 +790,151 @@ static int dns_name_length(unsigned char *buf)
 	return strlen((char *)buf) + 1;
 }
 
-static void update_cached_ttl(unsigned char *buf, int len, int new_ttl)
+/*
+ * Find the TTL fields of the cached resource records once when the
+ * data is added to the cache, so that serving it only needs to patch
+ * those fields in place. Fails if the records do not fit in the data.
+ */
+static int cache_data_index_ttl(struct cache_data *data)
 {
+	unsigned int records = data->answers + data->authority;
+	unsigned char *end = data->data + data->data_len;
 	unsigned char *c;
 	uint16_t w;
-	int l;
+	int len;
 
-	/* skip the header */
-	c = buf + 12;
-	len -= 12;
+	data->ttl_count = 0;
+	data->ttl_offsets = NULL;
+
+	if (records == 0)
+		return 0;
+
+	if (records <= G_N_ELEMENTS(data->ttl_buf))
+		data->ttl_offsets = data->ttl_buf;
+	else
+		data->ttl_offsets = g_new(uint16_t, records);
+
+	/* skip the TCP length and the header */
+	c = data->data + 2 + 12;
+	if (c > end)
+		return -EINVAL;
 
 	/* skip the query, which is a name and 2 16 bit words */
-	l = dns_name_length(c);
-	c += l;
-	len -= l;
-	c += 4;
-	len -= 4;
+	len = dn_skipname(c, end);
+	if (len < 0 || c + len + 4 > end)
+		return -EINVAL;
 
-	/* now we get the answer records */
+	c += len + 4;
 
-	while (len > 0) {
-		/* first a name */
-		l = dns_name_length(c);
-		c += l;
-		len -= l;
-		if (len < 0)
-			break;
-		/* then type + class, 2 bytes each */
-		c += 4;
-		len -= 4;
+	while (data->ttl_count < records && c < end) {
+		/* first a name, then type + class, 2 bytes each */
+		len = dn_skipname(c, end);
 		if (len < 0)
-			break;
+			return -EINVAL;
+
+		c += len + 4;
+
+		/* then the 4 byte TTL field and the 2 byte rdlen field */
+		if (c + 6 > end)
+			return -EINVAL;
+
+		data->ttl_offsets[data->ttl_count++] = c - data->data;
+
+		w = c[4] << 8 | c[5];
+		c += 6 + w;
+	}
+
+	if (data->ttl_count < records || c > end)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void update_cached_ttl(struct cache_data *data, int new_ttl)
+{
+	unsigned int i;
+
+	for (i = 0; i < data->ttl_count; i++) {
+		unsigned char *c = data->data + data->ttl_offsets[i];
 
-		/* now the 4 byte TTL field */
 		c[0] = new_ttl >> 24 & 0xff;
 		c[1] = new_ttl >> 16 & 0xff;
 		c[2] = new_ttl >> 8 & 0xff;
 		c[3] = new_ttl & 0xff;
-		c += 4;
-		len -= 4;
-		if (len < 0)
+	}
+}
+
+static bool udp_batch_queue(int sk, const void *buf, size_t len,
+			const struct sockaddr *to, socklen_t tolen)
+{
+	struct udp_batch *batch = reply_batch;
+	unsigned int i;
+
+	if (!batch || batch->sk != sk || batch->count >= UDP_BATCH_SIZE ||
+			!to || tolen > sizeof(batch->addr[0]) ||
+			len > max_udp_size)
+		return false;
+
+	/*
+	 * The cached data is patched for every client it is sent to,
+	 * so each queued reply needs its own copy.
+	 */
+	i = batch->count++;
+	batch->iov[i].iov_base = udp_batch_buf + i * max_udp_size;
+	batch->iov[i].iov_len = len;
+	memcpy(batch->iov[i].iov_base, buf, len);
+	memcpy(&batch->addr[i], to, tolen);
+
+	memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+	batch->msgs[i].msg_hdr.msg_name = &batch->addr[i];
+	batch->msgs[i].msg_hdr.msg_namelen = tolen;
+	batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+	batch->msgs[i].msg_hdr.msg_iovlen = 1;
+
+	return true;
+}
+
+static void udp_batch_flush(struct udp_batch *batch)
+{
+	unsigned int sent = 0;
+	int err;
+
+	while (sent < batch->count) {
+		err = sendmmsg(batch->sk, batch->msgs + sent,
+					batch->count - sent, MSG_NOSIGNAL);
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+
+			connman_error("Cannot send cached DNS response: %s",
+					strerror(errno));
+
+			/* skip the reply that failed and send the rest */
+			sent++;
+			continue;
+		}
+
+		if (err == 0)
 			break;
 
-		/* now the 2 byte rdlen field */
-		w = c[0] << 8 | c[1];
-		c += w + 2;
-		len -= w + 2;
+		sent += err;
 	}
+
+	debug("sk %d sent %u/%u cached replies", batch->sk, sent,
+							batch->count);
+
+	batch->count = 0;
 }
 
-static void send_cached_response(int sk, unsigned char *buf, int len,
+static void send_cached_response(int sk, struct cache_data *data,
 				const struct sockaddr *to, socklen_t tolen,
-				int protocol, int id, uint16_t answers, int ttl)
+				int protocol, int id, int ttl,
+				unsigned int udp_size)
 {
 	struct domain_hdr *hdr;
-	unsigned char *ptr = buf;
-	int err, offset, dns_len, adj_len = len - 2;
+	unsigned char *ptr = data->data;
+	int len = data->data_len;
+	int err, offset, dns_len;
 
 	/*
 	 * The cached packet contains always the TCP offset (two bytes)
@@ -443,19 +962,40 @@ static void send_cached_response(int sk, unsigned char *buf, int len,
 
 	hdr->id = id;
 	hdr->qr = 1;
-	hdr->rcode = ns_r_noerror;
-	hdr->ancount = htons(answers);
-	hdr->nscount = 0;
+	hdr->tc = 0;
+	hdr->rcode = data->rcode;
+	hdr->ancount = htons(data->answers);
+	hdr->nscount = htons(data->authority);
 	hdr->arcount = 0;
 
+	/*
+	 * An answer that is too large for the client is sent without
+	 * its records, so that the client repeats the query over TCP.
+	 */
+	if (protocol == IPPROTO_UDP && (unsigned int) len > udp_size) {
+		hdr->tc = 1;
+		hdr->ancount = 0;
+		hdr->nscount = 0;
+
+		len = 12 + strlen((char *) ptr + 12) + 1 + 4;
+		dns_len = len;
+	}
+
 	/* if this is a negative reply, we are authorative */
-	if (answers == 0)
+	if (data->answers == 0) {
 		hdr->aa = 1;
-	else
-		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
+		proxy_stats.negative_hits++;
+	}
 
-	debug("sk %d id 0x%04x answers %d ptr %p length %d dns %d",
-		sk, hdr->id, answers, ptr, len, dns_len);
+	update_cached_ttl(data, ttl);
+
+	debug("sk %d id 0x%04x rcode %d answers %d authority %d "
+		"ptr %p length %d dns %d", sk, hdr->id, data->rcode,
+		data->answers, data->authority, ptr, len, dns_len);
+
+	if (protocol == IPPROTO_UDP &&
+			udp_batch_queue(sk, ptr, len, to, tolen))
+		return;
 
 	err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
 	if (err < 0) {
@@ -508,6 +1048,9 @@ static int get_req_udp_socket(struct request_data *req)
 {
 	GIOChannel *channel;
 
+	if (!req->ifdata)
+		return -1;
+
 	if (req->family == AF_INET)
 		channel = req->ifdata->udp4_listener_channel;
 	else
@@ -519,29 +1062,430 @@ static int get_req_udp_socket(struct request_data *req)
 	return g_io_channel_unix_get_fd(channel);
 }
 
-static void destroy_request_data(struct request_data *req)
-{
-	if (req->timeout > 0)
-		g_source_remove(req->timeout);
+/*
+ * Every client address gets a token bucket that limits its query
+ * rate, and a limit on its queries waiting for the servers, so that
+ * a single client cannot crowd out the others. The local host is not
+ * limited, all local programs share the same address.
+ *
+ * At most CLIENT_TABLE_MAX clients are tracked. They are kept in
+ * client_lru by the time of their last query, so that idle clients
+ * can be dropped from its head without walking the whole table.
+ */
+#define CLIENT_BURST_FACTOR 2
+#define CLIENT_TABLE_MAX 1024
+#define CLIENT_IDLE_TIME 60000 /* ms */
+#define CLIENT_EVICT_SCAN 8
 
-	g_free(req->resp);
-	g_free(req->request);
-	g_free(req->name);
-	g_free(req);
-}
+struct client_data {
+	int family;
+	union {
+		struct in_addr in;
+		struct in6_addr in6;
+	} addr;
+	uint64_t updated; /* monotonic time in ms */
+	uint64_t tokens; /* in thousandths of a query */
+	unsigned int pending;
+	GList *lru_link;
+};
+
+static GHashTable *client_table;
+static GQueue client_lru;
+static unsigned int client_rate;
+static unsigned int client_max_pending;
 
-static gboolean request_timeout(gpointer user_data)
+static guint client_hash(gconstpointer key)
 {
-	struct request_data *req = user_data;
-	struct sockaddr *sa;
-	int sk;
+	const struct client_data *client = key;
+	const uint32_t *words = (const uint32_t *) &client->addr;
 
-	if (!req)
+	if (client->family == AF_INET)
+		return words[0];
+
+	return words[0] ^ words[1] ^ words[2] ^ words[3];
+}
+
+static gboolean client_equal(gconstpointer a, gconstpointer b)
+{
+	const struct client_data *client_a = a, *client_b = b;
+
+	if (client_a->family != client_b->family)
 		return FALSE;
 
+	if (client_a->family == AF_INET)
+		return client_a->addr.in.s_addr == client_b->addr.in.s_addr;
+
+	return IN6_ARE_ADDR_EQUAL(&client_a->addr.in6, &client_b->addr.in6);
+}
+
+static void client_remove(struct client_data *client)
+{
+	g_queue_delete_link(&client_lru, client->lru_link);
+	g_hash_table_remove(client_table, client);
+}
+
+/* Drop the clients that have been idle for a while */
+static void client_expire(uint64_t now)
+{
+	GList *link;
+
+	while ((link = g_queue_peek_head_link(&client_lru))) {
+		struct client_data *client = link->data;
+
+		if (client->pending > 0 ||
+				now - client->updated <= CLIENT_IDLE_TIME)
+			break;
+
+		client_remove(client);
+	}
+}
+
+/*
+ * Make room for a new client by dropping the least recently seen one
+ * that has no queries pending. Returns false if there is none among
+ * the oldest few.
+ */
+static bool client_evict(void)
+{
+	GList *link = g_queue_peek_head_link(&client_lru);
+	unsigned int i;
+
+	for (i = 0; link && i < CLIENT_EVICT_SCAN; i++, link = link->next) {
+		struct client_data *client = link->data;
+
+		if (client->pending == 0) {
+			client_remove(client);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Take a token for a query from the client. Returns false if the
+ * query has to be dropped. The client is set to NULL if it is not
+ * limited.
+ */
+static bool client_admit(int family, const void *sa,
+				struct client_data **client)
+{
+	struct client_data key, *data;
+	uint64_t burst = (uint64_t) client_rate * CLIENT_BURST_FACTOR * 1000;
+	uint64_t now;
+
+	*client = NULL;
+
+	if (!client_table || (client_rate == 0 && client_max_pending == 0))
+		return true;
+
+	memset(&key, 0, sizeof(key));
+	key.family = family;
+
+	if (family == AF_INET) {
+		key.addr.in = ((const struct sockaddr_in *) sa)->sin_addr;
+		if (ntohl(key.addr.in.s_addr) >> 24 == IN_LOOPBACKNET)
+			return true;
+	} else if (family == AF_INET6) {
+		key.addr.in6 = ((const struct sockaddr_in6 *) sa)->sin6_addr;
+		if (IN6_IS_ADDR_LOOPBACK(&key.addr.in6))
+			return true;
+	} else
+		return true;
+
+	now = monotonic_ms();
+
+	client_expire(now);
+
+	data = g_hash_table_lookup(client_table, &key);
+	if (data) {
+		g_queue_unlink(&client_lru, data->lru_link);
+		g_queue_push_tail_link(&client_lru, data->lru_link);
+	} else {
+		/* a client that does not fit is not limited */
+		if (g_hash_table_size(client_table) >= CLIENT_TABLE_MAX &&
+							!client_evict())
+			return true;
+
+		data = g_memdup(&key, sizeof(key));
+		data->updated = now;
+		data->tokens = burst;
+		g_hash_table_replace(client_table, data, data);
+
+		g_queue_push_tail(&client_lru, data);
+		data->lru_link = g_queue_peek_tail_link(&client_lru);
+	}
+
+	*client = data;
+
+	if (client_rate == 0) {
+		data->updated = now;
+		return true;
+	}
+
+	/* the rate is in queries per second, i.e. thousandths per ms */
+	data->tokens = MIN(burst, data->tokens +
+				(now - data->updated) * client_rate);
+	data->updated = now;
+
+	if (data->tokens < 1000) {
+		proxy_stats.rate_limited++;
+		return false;
+	}
+
+	data->tokens -= 1000;
+
+	return true;
+}
+
+static bool client_pending_full(struct client_data *client)
+{
+	if (!client || client_max_pending == 0 ||
+			client->pending < client_max_pending)
+		return false;
+
+	return true;
+}
+
+static void request_set_client(struct request_data *req,
+				struct client_data *client)
+{
+	req->client = client;
+
+	if (client)
+		client->pending++;
+}
+
+/*
+ * Keep a copy of the query and the name of a request, in the buffers
+ * of the request itself when they fit. Without a query, a zeroed one
+ * of the given length is set up.
+ */
+static void request_set_query(struct request_data *req,
+				const void *request, gsize len,
+				const char *name)
+{
+	if (len <= sizeof(req->request_buf))
+		req->request = req->request_buf;
+	else
+		req->request = g_malloc(len);
+
+	if (request)
+		memcpy(req->request, request, len);
+	else
+		memset(req->request, 0, len);
+
+	req->request_len = len;
+
+	if (strlen(name) < sizeof(req->name_buf))
+		req->name = strcpy(req->name_buf, name);
+	else
+		req->name = g_strdup(name);
+}
+
+/*
+ * A prefetch is over, whether it was answered or not. Allow the
+ * cached data it was refreshing to be prefetched again.
+ */
+static void cache_prefetch_done(struct request_data *req)
+{
+	struct cache_entry *entry;
+	struct cache_data *data;
+	struct domain_question *q;
+	char *question;
+
+	if (!cache)
+		return;
+
+	question = req->request + sizeof(struct domain_hdr);
+
+	entry = g_hash_table_lookup(cache, question);
+	if (!entry)
+		return;
+
+	q = (void *) (question + strlen(question) + 1);
+
+	data = cache_entry_get(entry, ntohs(q->type), ntohs(q->class));
+	if (data)
+		data->prefetching = false;
+}
+
+/*
+ * The request does not wait for the servers any more, so it no longer
+ * keeps their TCP connections from going idle.
+ */
+static void request_forget_tcp(struct request_data *req)
+{
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *server = list->data;
+		GSList *link;
+
+		if (server->protocol != IPPROTO_TCP)
+			continue;
+
+		link = g_slist_find(server->pending,
+					GUINT_TO_POINTER(req->dstid));
+		if (!link)
+			continue;
+
+		server->pending = g_slist_delete_link(server->pending, link);
+		tcp_server_touch(server);
+	}
+}
+
+static void destroy_request_data(struct request_data *req)
+{
+	request_timer_stop(req);
+	request_remove(req);
+
+	if (req->protocol == IPPROTO_TCP)
+		request_forget_tcp(req);
+
+	if (req->prefetch)
+		cache_prefetch_done(req);
+
+	g_slist_free_full(req->waiters,
+				(GDestroyNotify) destroy_request_data);
+
+	g_slist_free(req->raced);
+
+	g_free(req->resp);
+
+	if (req->request != req->request_buf)
+		g_free(req->request);
+
+	if (req->name != req->name_buf)
+		g_free(req->name);
+
+	if (req->client)
+		req->client->pending--;
+
+	pool_free(&request_pool, req);
+}
+
+/*
+ * None of the servers answered the query, or there are no servers to
+ * ask. Answer it with expired data from the cache if serve-stale is
+ * enabled and the data is still within the staleness window.
+ */
+static bool cache_send_stale_query(int sk, unsigned char *request,
+				int request_len, int protocol,
+				const struct sockaddr *sa, socklen_t sa_len,
+				int id, unsigned int udp_size)
+{
+	struct cache_entry *entry;
+	struct cache_data *data;
+	struct domain_question *q;
+	char *question;
+	int offset;
+
+	if (stale_max_time == 0 || !cache || sk < 0)
+		return false;
+
+	offset = protocol_offset(protocol);
+	if (offset < 0 || request_len < offset + 12 + 1 +
+				(int) sizeof(struct domain_question))
+		return false;
+
+	question = (char *) request + offset + 12;
+
+	entry = g_hash_table_lookup(cache, question);
+	if (!entry)
+		return false;
+
+	q = (void *) (question + strlen(question) + 1);
+
+	data = cache_entry_get_stale(entry, ntohs(q->type), ntohs(q->class));
+	if (!data || data->cache_until + (time_t) stale_max_time < time(NULL))
+		return false;
+
+	debug("serving stale \"%s\" type %d", entry->key, data->type);
+
+	proxy_stats.stale_hits++;
+
+	send_cached_response(sk, data, sa, sa_len, protocol, id,
+				STALE_ANSWER_TTL, udp_size);
+
+	return true;
+}
+
+static bool cache_send_stale(struct request_data *req, int sk,
+				const struct sockaddr *sa)
+{
+	return cache_send_stale_query(sk, req->request, req->request_len,
+				req->protocol, sa, req->sa_len, req->srcid,
+				req->udp_size);
+}
+
+/*
+ * The request was answered from the cache without a reply from the
+ * servers, so the requests waiting for it have to be resolved on
+ * their own.
+ */
+static void request_resolv_waiters(struct request_data *req)
+{
+	unsigned char *request;
+
+	while (req->waiters) {
+		struct request_data *waiter = req->waiters->data;
+
+		req->waiters = g_slist_delete_link(req->waiters,
+							req->waiters);
+
+		waiter->dstid = get_id();
+		waiter->altid = get_id();
+
+		request = waiter->request;
+		request[0] = waiter->dstid & 0xff;
+		request[1] = waiter->dstid >> 8;
+
+		if (resolv(waiter, waiter->request, waiter->name)) {
+			destroy_request_data(waiter);
+			continue;
+		}
+
+		request_timer_start(waiter, waiter->failover ?
+						FAILOVER_TIMEOUT : 5);
+		request_add(waiter);
+	}
+}
+
+static void request_timeout(struct request_data *req)
+{
+	struct sockaddr *sa;
+	int sk;
+
 	debug("id 0x%04x", req->srcid);
 
-	request_list = g_slist_remove(request_list, req);
+	/*
+	 * Only the best servers were asked so far, give the others
+	 * a chance before failing the request.
+	 */
+	if (req->failover) {
+		req->failover = false;
+		req->retransmit = true;
+
+		if (resolv(req, req->request, req->name)) {
+			request_remove(req);
+			request_resolv_waiters(req);
+			destroy_request_data(req);
+			return;
+		}
+
+		request_timer_start(req, 5 - FAILOVER_TIMEOUT);
+		return;
+	}
+
+	request_remove(req);
+
+	/* coalesced requests have not been sent anywhere themselves */
+	if (!req->resp && req->numserv > 0)
+		proxy_stats.upstream_timeouts++;
+
+	if (req->prefetch)
+		goto out;
 
 	if (req->protocol == IPPROTO_UDP) {
 		sk = get_req_udp_socket(req);
@@ -562,7 +1506,7 @@ static gboolean request_timeout(gpointer user_data)
 			sendto(sk, req->resp, req->resplen, MSG_NOSIGNAL,
 				sa, req->sa_len);
 
-	} else if (req->request) {
+	} else if (req->request && !cache_send_stale(req, sk, sa)) {
 		/*
 		 * There was not reply from server at all.
 		 */
@@ -587,10 +1531,78 @@ static gboolean request_timeout(gpointer user_data)
 	}
 
 out:
-	req->timeout = 0;
+	while (req->waiters) {
+		struct request_data *waiter = req->waiters->data;
+
+		req->waiters = g_slist_delete_link(req->waiters,
+							req->waiters);
+
+		if (req->resplen > 0 && req->resp) {
+			unsigned char *resp;
+
+			resp = g_memdup(req->resp, req->resplen);
+			resp[0] = waiter->srcid & 0xff;
+			resp[1] = waiter->srcid >> 8;
+
+			waiter->resp = resp;
+			waiter->resplen = req->resplen;
+		}
+
+		request_timeout(waiter);
+	}
+
 	destroy_request_data(req);
+}
 
-	return FALSE;
+static gboolean request_wheel_tick(gpointer user_data)
+{
+	GQueue *slot;
+	struct request_data *req;
+
+	request_wheel_pos = (request_wheel_pos + 1) % REQUEST_WHEEL_SLOTS;
+	slot = &request_wheel[request_wheel_pos];
+
+	while ((req = g_queue_pop_head(slot))) {
+		req->timeout_link = NULL;
+		request_wheel_count--;
+
+		request_timeout(req);
+	}
+
+	if (request_wheel_count == 0) {
+		request_wheel_timer = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void request_timer_start(struct request_data *req,
+						unsigned int seconds)
+{
+	unsigned int slot;
+
+	request_timer_stop(req);
+
+	/*
+	 * The next tick can be anywhere up to a second away, so round
+	 * up by one slot to never expire a request early.
+	 */
+	seconds++;
+
+	if (seconds >= REQUEST_WHEEL_SLOTS)
+		seconds = REQUEST_WHEEL_SLOTS - 1;
+
+	slot = (request_wheel_pos + seconds) % REQUEST_WHEEL_SLOTS;
+
+	g_queue_push_tail(&request_wheel[slot], req);
+	req->timeout_link = g_queue_peek_tail_link(&request_wheel[slot]);
+	req->timeout_slot = slot;
+	request_wheel_count++;
+
+	if (request_wheel_timer == 0)
+		request_wheel_timer = g_timeout_add_seconds(1,
+						request_wheel_tick, NULL);
 }
 
 static int append_query(unsigned char *buf, unsigned int size,
@@ -660,138 +1672,654 @@ static bool cache_check_is_valid(struct cache_data *data,
 	return true;
 }
 
+static void cache_data_free(struct cache_data *data)
+{
+	if (!data)
+		return;
+
+	if (data->ttl_offsets != data->ttl_buf)
+		g_free(data->ttl_offsets);
+
+	if (data->data != data->data_buf)
+		g_free(data->data);
+
+	pool_free(&cache_data_pool, data);
+}
+
+/* Get a buffer of data_len bytes for the data of the answer */
+static unsigned char *cache_data_buffer(struct cache_data *data)
+{
+	if (data->data_len <= sizeof(data->data_buf))
+		data->data = data->data_buf;
+	else
+		data->data = g_malloc(data->data_len);
+
+	return data->data;
+}
+
+static unsigned int cache_data_size(struct cache_data *data)
+{
+	unsigned int size = sizeof(GSList) + sizeof(*data);
+
+	if (data->data != data->data_buf)
+		size += data->data_len;
+
+	if (data->ttl_offsets != data->ttl_buf)
+		size += data->ttl_count * sizeof(uint16_t);
+
+	return size;
+}
+
+/*
+ * Recalculate the memory used by the entry after its cached data
+ * has been added or removed.
+ */
+static void cache_entry_resize(struct cache_entry *entry)
+{
+	GSList *list;
+
+	cache_mem -= entry->size;
+
+	entry->size = sizeof(*entry) + strlen(entry->key) + 1;
+
+	for (list = entry->records; list; list = list->next)
+		entry->size += cache_data_size(list->data);
+
+	for (list = entry->stale; list; list = list->next)
+		entry->size += cache_data_size(list->data);
+
+	cache_mem += entry->size;
+}
+
+static bool cache_entry_is_valid(struct cache_entry *entry,
+					time_t current_time)
+{
+	GSList *list;
+
+	for (list = entry->records; list; list = list->next) {
+		if (cache_check_is_valid(list->data, current_time))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Only host name lookups can be refreshed, see refresh_dns_entry()
+ */
+static bool cache_entry_is_host(struct cache_entry *entry)
+{
+	return cache_entry_get(entry, ns_t_a, ns_c_in) ||
+		cache_entry_get(entry, ns_t_aaaa, ns_c_in);
+}
+
+static void cache_entry_clear(struct cache_entry *entry)
+{
+	g_slist_free_full(entry->records,
+				(GDestroyNotify) cache_data_free);
+	entry->records = NULL;
+
+	g_slist_free_full(entry->stale,
+				(GDestroyNotify) cache_data_free);
+	entry->stale = NULL;
+}
+
+static void cache_entry_drop_stale(struct cache_entry *entry,
+					uint16_t type, uint16_t class)
+{
+	struct cache_data *data = cache_entry_get_stale(entry, type, class);
+
+	if (!data)
+		return;
+
+	entry->stale = g_slist_remove(entry->stale, data);
+	cache_data_free(data);
+}
+
+/*
+ * Take data that is no longer valid out of use. It is either freed
+ * or, with serve-stale enabled, kept in the stale list of the entry.
+ * The caller has already removed it from the records list.
+ */
+static void cache_entry_expire(struct cache_entry *entry,
+				struct cache_data *data)
+{
+	if (stale_max_time == 0) {
+		cache_data_free(data);
+		return;
+	}
+
+	cache_entry_drop_stale(entry, data->type, data->class);
+
+	data->prefetching = false;
+	entry->stale = g_slist_prepend(entry->stale, data);
+}
+
+/*
+ * We only cache the record types that are commonly queried and whose
+ * answers we know how to rewrite. DNSSEC records, zone transfers and
+ * meta queries are always passed to the server.
+ */
+static bool cache_type_supported(uint16_t type)
+{
+	switch (type) {
+	case ns_t_a:
+	case ns_t_ns:
+	case ns_t_cname:
+	case ns_t_soa:
+	case ns_t_ptr:
+	case ns_t_mx:
+	case ns_t_txt:
+	case ns_t_aaaa:
+	case ns_t_srv:
+	case ns_t_naptr:
+	case 64:	/* SVCB */
+	case 65:	/* HTTPS */
+	case 257:	/* CAA */
+		return true;
+	}
+
+	return false;
+}
+
 /*
  * remove stale cached entries so that they can be refreshed
  */
 static void cache_enforce_validity(struct cache_entry *entry)
 {
 	time_t current_time = time(NULL);
+	GSList *list = entry->records;
 
-	if (!cache_check_is_valid(entry->ipv4, current_time)
-							&& entry->ipv4) {
-		debug("cache timeout \"%s\" type A", entry->key);
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
+	while (list) {
+		struct cache_data *data = list->data;
+		GSList *next = list->next;
+
+		if (!cache_check_is_valid(data, current_time)) {
+			debug("cache timeout \"%s\" type %d", entry->key,
+								data->type);
+			entry->records = g_slist_delete_link(entry->records,
+									list);
+			cache_entry_expire(entry, data);
+		}
 
+		list = next;
 	}
 
-	if (!cache_check_is_valid(entry->ipv6, current_time)
-							&& entry->ipv6) {
-		debug("cache timeout \"%s\" type AAAA", entry->key);
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
+	/* stale data is dropped when the staleness window is over */
+	list = entry->stale;
+	while (list) {
+		struct cache_data *data = list->data;
+		GSList *next = list->next;
+
+		if (data->cache_until + (time_t) stale_max_time <
+							current_time) {
+			entry->stale = g_slist_delete_link(entry->stale, list);
+			cache_data_free(data);
+		}
+
+		list = next;
 	}
+
+	cache_entry_resize(entry);
 }
 
-static uint16_t cache_check_validity(char *question, uint16_t type,
-				struct cache_entry *entry)
+static bool cache_check_validity(char *question, uint16_t type,
+				uint16_t class, struct cache_entry *entry)
 {
-	time_t current_time = time(NULL);
 	bool want_refresh = false;
 
 	/*
-	 * if we have a popular entry, we want a refresh instead of
+	 * if we have a popular host entry, we want a refresh instead of
 	 * total destruction of the entry.
 	 */
-	if (entry->hits > 2)
+	if (entry->hits > 2 && (type == ns_t_a || type == ns_t_aaaa))
 		want_refresh = true;
 
 	cache_enforce_validity(entry);
 
-	switch (type) {
-	case 1:		/* IPv4 */
-		if (!cache_check_is_valid(entry->ipv4, current_time)) {
-			debug("cache %s \"%s\" type A", entry->ipv4 ?
-					"timeout" : "entry missing", question);
+	if (!cache_entry_get(entry, type, class)) {
+		debug("cache timeout or entry missing \"%s\" type %d",
+							question, type);
 
-			if (want_refresh)
-				entry->want_refresh = true;
+		if (want_refresh)
+			entry->want_refresh = true;
 
-			/*
-			 * We do not remove cache entry if there is still
-			 * valid IPv6 entry found in the cache.
-			 */
-			if (!cache_check_is_valid(entry->ipv6, current_time) && !want_refresh) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
+		/*
+		 * We do not remove cache entry if there is still
+		 * valid data of some other type found in the cache,
+		 * or expired data that can still be served stale.
+		 */
+		if (!entry->records && !entry->stale && !want_refresh) {
+			g_hash_table_remove(cache, question);
+			return false;
 		}
-		break;
+	}
+
+	return true;
+}
+
+static void cache_element_destroy(gpointer value)
+{
+	struct cache_entry *entry = value;
+
+	if (!entry)
+		return;
+
+	if (entry->lru_link)
+		g_queue_delete_link(&cache_lru, entry->lru_link);
+
+	cache_mem -= entry->size;
+
+	cache_entry_clear(entry);
+
+	g_free(entry->key);
+	pool_free(&cache_entry_pool, entry);
+
+	if (--cache_size < 0)
+		cache_size = 0;
+}
 
-	case 28:	/* IPv6 */
-		if (!cache_check_is_valid(entry->ipv6, current_time)) {
-			debug("cache %s \"%s\" type AAAA", entry->ipv6 ?
-					"timeout" : "entry missing", question);
+/*
+ * Make room for "needed" more bytes in the cache. Entries are taken
+ * from the cold end of the LRU list. An entry which still has valid
+ * data and has been hit since it was last examined gets a second
+ * chance: its hit count is halved and it is moved back to the hot
+ * end (CLOCK). Every entry is given at most one second chance per
+ * call, so the loop always terminates.
+ */
+static void cache_evict(unsigned int needed)
+{
+	time_t current_time = time(NULL);
+	unsigned int chances = g_queue_get_length(&cache_lru);
+
+	while (cache_mem + needed > cache_max_mem) {
+		GList *link = g_queue_peek_tail_link(&cache_lru);
+		struct cache_entry *entry;
+
+		if (!link)
+			break;
+
+		entry = link->data;
 
-			if (want_refresh)
-				entry->want_refresh = true;
+		if (chances > 0 && entry->hits > 0 &&
+				cache_entry_is_valid(entry, current_time)) {
+			entry->hits /= 2;
+			g_queue_unlink(&cache_lru, link);
+			g_queue_push_head_link(&cache_lru, link);
+			chances--;
+			continue;
+		}
+
+		debug("evict \"%s\" hits %d size %u", entry->key,
+			entry->hits, entry->size);
+
+		proxy_stats.cache_evictions++;
+
+		g_hash_table_remove(cache, entry->key);
+	}
+}
 
-			if (!cache_check_is_valid(entry->ipv4, current_time) && !want_refresh) {
-				g_hash_table_remove(cache, question);
-				type = 0;
+static gboolean try_remove_cache(gpointer user_data)
+{
+	cache_timer = 0;
+
+	if (__sync_fetch_and_sub(&cache_refcount, 1) == 1) {
+		debug("No cache users, removing it.");
+
+		g_hash_table_destroy(cache);
+		cache = NULL;
+	}
+
+	return FALSE;
+}
+
+/*
+ * The cache can be saved to disk so that it survives a restart. The
+ * snapshot is a header followed by fixed size records, each followed
+ * by the key and the wire format data of one cached answer, padded to
+ * 8 bytes so that the file can be used in place when it is mapped.
+ * The times are wall clock times, so the TTLs of the answers are
+ * adjusted to the time spent in between when they are served.
+ */
+#define CACHE_SNAPSHOT_FILE STORAGEDIR "/dnsproxy.cache"
+#define CACHE_SNAPSHOT_MAGIC 0x444e5343
+#define CACHE_SNAPSHOT_VERSION 1
+#define CACHE_SNAPSHOT_ALIGN(len) (((len) + 7) & ~7)
+
+struct cache_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t size;
+};
+
+struct cache_snapshot_record {
+	int64_t inserted;
+	int64_t valid_until;
+	int64_t cache_until;
+	int32_t timeout;
+	uint32_t hits;
+	uint16_t type;
+	uint16_t class;
+	uint16_t answers;
+	uint16_t authority;
+	uint16_t key_len; /* including the terminating nul */
+	uint8_t rcode;
+	uint8_t reserved;
+	uint32_t data_len;
+};
+
+static unsigned int cache_snapshot_interval;
+static guint cache_snapshot_timer;
+static bool cache_snapshot_dirty;
+static bool cache_snapshot_loaded;
+
+static size_t cache_snapshot_record_size(const char *key,
+					const struct cache_data *data)
+{
+	return CACHE_SNAPSHOT_ALIGN(sizeof(struct cache_snapshot_record) +
+					strlen(key) + 1 + data->data_len);
+}
+
+static size_t cache_snapshot_fill(char *addr)
+{
+	struct cache_snapshot_header *hdr = (void *) addr;
+	time_t current_time = time(NULL);
+	GHashTableIter iter;
+	gpointer value;
+	size_t len = sizeof(*hdr);
+	uint32_t count = 0;
+
+	g_hash_table_iter_init(&iter, cache);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct cache_entry *entry = value;
+		size_t key_len = strlen(entry->key) + 1;
+		GSList *list;
+
+		for (list = entry->records; list; list = list->next) {
+			struct cache_data *data = list->data;
+			struct cache_snapshot_record *rec;
+
+			if (!cache_check_is_valid(data, current_time))
+				continue;
+
+			if (addr) {
+				rec = (void *) (addr + len);
+				memset(rec, 0, cache_snapshot_record_size(
+							entry->key, data));
+
+				rec->inserted = data->inserted;
+				rec->valid_until = data->valid_until;
+				rec->cache_until = data->cache_until;
+				rec->timeout = data->timeout;
+				rec->hits = entry->hits;
+				rec->type = data->type;
+				rec->class = data->class;
+				rec->answers = data->answers;
+				rec->authority = data->authority;
+				rec->key_len = key_len;
+				rec->rcode = data->rcode;
+				rec->data_len = data->data_len;
+
+				memcpy(rec + 1, entry->key, key_len);
+				memcpy((char *) (rec + 1) + key_len,
+						data->data, data->data_len);
 			}
+
+			len += cache_snapshot_record_size(entry->key, data);
+			count++;
 		}
-		break;
 	}
 
-	return type;
+	if (addr) {
+		hdr->magic = CACHE_SNAPSHOT_MAGIC;
+		hdr->version = CACHE_SNAPSHOT_VERSION;
+		hdr->count = count;
+		hdr->size = len;
+	}
+
+	return len;
 }
 
-static void cache_element_destroy(gpointer value)
+static void cache_snapshot_save(void)
 {
-	struct cache_entry *entry = value;
+	char *tmpname;
+	void *addr;
+	size_t len;
+	int fd;
 
-	if (!entry)
+	if (cache_snapshot_interval == 0 || !cache)
 		return;
 
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
+	/* the first pass computes the size of the snapshot */
+	len = cache_snapshot_fill(NULL);
+
+	tmpname = g_strdup_printf("%s.tmp", CACHE_SNAPSHOT_FILE);
+
+	fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+						S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		connman_error("Cannot create %s: %s", tmpname,
+							strerror(errno));
+		goto out;
 	}
 
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
+	if (ftruncate(fd, len) < 0) {
+		connman_error("Cannot resize %s: %s", tmpname,
+							strerror(errno));
+		goto error;
 	}
 
-	g_free(entry->key);
-	g_free(entry);
+	addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		connman_error("Cannot map %s: %s", tmpname, strerror(errno));
+		goto error;
+	}
 
-	if (--cache_size < 0)
-		cache_size = 0;
+	cache_snapshot_fill(addr);
+
+	msync(addr, len, MS_SYNC);
+	munmap(addr, len);
+	close(fd);
+
+	if (rename(tmpname, CACHE_SNAPSHOT_FILE) < 0) {
+		connman_error("Cannot rename %s: %s", tmpname,
+							strerror(errno));
+		unlink(tmpname);
+		goto out;
+	}
+
+	debug("saved %zu bytes of cache", len);
+
+	cache_snapshot_dirty = false;
+	goto out;
+
+error:
+	close(fd);
+	unlink(tmpname);
+out:
+	g_free(tmpname);
 }
 
-static gboolean try_remove_cache(gpointer user_data)
-{
-	cache_timer = 0;
+static gboolean cache_snapshot_timeout(gpointer user_data)
+{
+	if (cache_snapshot_dirty)
+		cache_snapshot_save();
+
+	return TRUE;
+}
+
+/*
+ * Add a saved answer to the cache. Everything in it is checked, as
+ * the file may be damaged or left by an incompatible version.
+ */
+static void cache_snapshot_insert(const struct cache_snapshot_record *rec,
+					time_t current_time)
+{
+	const char *key = (const char *) (rec + 1);
+	const unsigned char *msg = (const unsigned char *) key + rec->key_len;
+	struct cache_entry *entry;
+	struct cache_data *data;
+	size_t needed;
+
+	if (rec->key_len < 2 || key[rec->key_len - 1] != '\0' ||
+			strlen(key) + 1 != rec->key_len)
+		return;
+
+	/* TCP length, header, the question and its type and class */
+	if (rec->data_len < 2 + 12 + rec->key_len + 4 ||
+			rec->data_len > 2 + TCP_MAX_BUF_LEN ||
+			(unsigned int) (msg[0] << 8 | msg[1]) !=
+							rec->data_len - 2 ||
+			memcmp(msg + 2 + 12, key, rec->key_len) != 0)
+		return;
+
+	if (!cache_type_supported(rec->type) ||
+			rec->cache_until < current_time ||
+			rec->inserted > current_time ||
+			rec->timeout <= 0)
+		return;
+
+	entry = g_hash_table_lookup(cache, key);
+	if (entry && cache_entry_get(entry, rec->type, rec->class))
+		return;
+
+	needed = sizeof(*data) + sizeof(GSList) + rec->data_len;
+	if (!entry)
+		needed += sizeof(*entry) + rec->key_len;
+
+	if (cache_mem + needed > cache_max_mem)
+		return;
+
+	data = pool_alloc(&cache_data_pool);
+	if (!data)
+		return;
+
+	data->inserted = rec->inserted;
+	data->valid_until = rec->valid_until;
+	data->cache_until = rec->cache_until;
+	data->timeout = rec->timeout;
+	data->type = rec->type;
+	data->class = rec->class;
+	data->rcode = rec->rcode;
+	data->answers = rec->answers;
+	data->authority = rec->authority;
+	data->data_len = rec->data_len;
+	memcpy(cache_data_buffer(data), msg, rec->data_len);
+
+	if (cache_data_index_ttl(data) < 0) {
+		debug("ignoring damaged cache snapshot record");
+		cache_data_free(data);
+		return;
+	}
+
+	if (!entry) {
+		entry = pool_alloc(&cache_entry_pool);
+		if (!entry) {
+			cache_data_free(data);
+			return;
+		}
+
+		entry->key = g_strdup(key);
+		entry->hits = MIN(rec->hits, (uint32_t) G_MAXINT);
+
+		g_hash_table_replace(cache, entry->key, entry);
+		g_queue_push_tail(&cache_lru, entry);
+		entry->lru_link = g_queue_peek_tail_link(&cache_lru);
+		cache_size++;
+	}
+
+	entry->records = g_slist_prepend(entry->records, data);
+	cache_entry_resize(entry);
+}
+
+static void cache_snapshot_load(void)
+{
+	const struct cache_snapshot_header *hdr;
+	time_t current_time = time(NULL);
+	struct stat st;
+	char *addr;
+	size_t offset;
+	uint32_t i;
+	int fd;
+
+	if (cache_snapshot_interval == 0 || cache_max_mem == 0)
+		return;
+
+	fd = open(CACHE_SNAPSHOT_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*hdr)) {
+		close(fd);
+		return;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return;
+
+	hdr = (void *) addr;
+	if (hdr->magic != CACHE_SNAPSHOT_MAGIC ||
+			hdr->version != CACHE_SNAPSHOT_VERSION ||
+			hdr->size != st.st_size) {
+		debug("ignoring invalid cache snapshot");
+		goto out;
+	}
+
+	offset = sizeof(*hdr);
+
+	for (i = 0; i < hdr->count; i++) {
+		const struct cache_snapshot_record *rec;
+		size_t len;
+
+		if (offset + sizeof(*rec) > hdr->size)
+			break;
+
+		rec = (void *) (addr + offset);
 
-	if (__sync_fetch_and_sub(&cache_refcount, 1) == 1) {
-		debug("No cache users, removing it.");
+		len = CACHE_SNAPSHOT_ALIGN(sizeof(*rec) + rec->key_len +
+							rec->data_len);
+		if (len > hdr->size - offset)
+			break;
 
-		g_hash_table_destroy(cache);
-		cache = NULL;
+		cache_snapshot_insert(rec, current_time);
+
+		offset += len;
 	}
 
-	return FALSE;
+	debug("loaded %d cache entries from %u saved answers",
+						cache_size, hdr->count);
+
+out:
+	munmap(addr, st.st_size);
 }
 
 static void create_cache(void)
 {
-	if (__sync_fetch_and_add(&cache_refcount, 1) == 0)
+	if (__sync_fetch_and_add(&cache_refcount, 1) == 0) {
 		cache = g_hash_table_new_full(g_str_hash,
 					g_str_equal,
 					NULL,
 					cache_element_destroy);
+
+		/* a saved cache is only of use right after a restart */
+		if (!cache_snapshot_loaded) {
+			cache_snapshot_loaded = true;
+			cache_snapshot_load();
+		}
+	}
 }
 
-static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
+static struct cache_entry *cache_check(gpointer request,
+					struct cache_data **data, int proto)
 {
 	char *question;
 	struct cache_entry *entry;
 	struct domain_question *q;
-	uint16_t type;
+	uint16_t type, class;
 	int offset, proto_offset;
 
 	if (!request)
@@ -806,9 +2334,9 @@ static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
 	offset = strlen(question) + 1;
 	q = (void *) (question + offset);
 	type = ntohs(q->type);
+	class = ntohs(q->class);
 
-	/* We only cache either A (1) or AAAA (28) requests */
-	if (type != 1 && type != 28)
+	if (!cache_type_supported(type))
 		return NULL;
 
 	if (!cache) {
@@ -820,14 +2348,47 @@ static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
 	if (!entry)
 		return NULL;
 
-	type = cache_check_validity(question, type, entry);
-	if (type == 0)
+	if (!cache_check_validity(question, type, class, entry))
 		return NULL;
 
-	*qtype = type;
+	*data = cache_entry_get(entry, type, class);
 	return entry;
 }
 
+/*
+ * There are no servers to ask, so the cache is all there is. Answer
+ * the query from valid data if there is any, else from stale data.
+ */
+static bool cache_send_offline(int sk, unsigned char *request,
+				int request_len, int protocol,
+				const struct sockaddr *sa, socklen_t sa_len,
+				unsigned int udp_size)
+{
+	struct cache_entry *entry;
+	struct cache_data *data = NULL;
+	int offset, id;
+
+	offset = protocol_offset(protocol);
+	if (offset < 0 || request_len < offset + 12 + 1 +
+				(int) sizeof(struct domain_question))
+		return false;
+
+	id = request[offset] | (request[offset + 1] << 8);
+
+	entry = cache_check(request, &data, protocol);
+	if (entry && data) {
+		entry->hits++;
+		proxy_stats.cache_hits++;
+
+		send_cached_response(sk, data, sa, sa_len, protocol, id,
+				data->valid_until - time(NULL), udp_size);
+		return true;
+	}
+
+	return cache_send_stale_query(sk, request, request_len, protocol,
+					sa, sa_len, id, udp_size);
+}
+
 /*
  * Get a label/name from DNS resource record. The function decompresses the
  * label if necessary. The function does not convert the name to presentation
@@ -895,6 +2456,100 @@ static int get_name(int counter,
 	return 0;
 }
 
+/*
+ * Copy a possibly compressed name from the packet to the output buffer
+ * in uncompressed wire format. The number of bytes the name occupied
+ * in the packet is returned in used.
+ */
+static int copy_name(unsigned char *pkt, unsigned char *max,
+			unsigned char *ptr, unsigned char *output,
+			int output_max, int *used)
+{
+	char name[NS_MAXDNAME];
+	int pos, len;
+
+	pos = dn_expand(pkt, max, ptr, name, sizeof(name));
+	if (pos < 0)
+		return -EINVAL;
+
+	len = dn_comp(name, output, output_max, NULL, NULL);
+	if (len < 0)
+		return -ENOBUFS;
+
+	*used = pos;
+
+	return len;
+}
+
+/*
+ * Copy the rdata of a resource record to the output buffer. Names
+ * inside the rdata of the well known types may be compressed, and
+ * the compression pointers would not be valid in the cached packet,
+ * so those names are stored uncompressed. Other types are not allowed
+ * to use compression (RFC 3597) and are copied as is.
+ */
+static int copy_rdata(unsigned char *pkt, unsigned char *max,
+			uint16_t type, unsigned char *rdata, int rdlen,
+			unsigned char *output, int output_max)
+{
+	unsigned char *end = rdata + rdlen;
+	int head = 0, names = 0, tail = 0;
+	int len, used, ret;
+
+	switch (type) {
+	case ns_t_ns:
+	case ns_t_cname:
+	case ns_t_ptr:
+		names = 1;
+		break;
+	case ns_t_mx:
+		head = 2;	/* preference */
+		names = 1;
+		break;
+	case ns_t_srv:
+		head = 6;	/* priority, weight and port */
+		names = 1;
+		break;
+	case ns_t_soa:
+		names = 2;
+		tail = 20;	/* serial, refresh, retry, expire, minimum */
+		break;
+	default:
+		if (rdlen > output_max)
+			return -ENOBUFS;
+
+		memcpy(output, rdata, rdlen);
+		return rdlen;
+	}
+
+	if (head > rdlen || head > output_max)
+		return -EINVAL;
+
+	memcpy(output, rdata, head);
+	rdata += head;
+	len = head;
+
+	while (names-- > 0) {
+		ret = copy_name(pkt, max, rdata, output + len,
+				output_max - len, &used);
+		if (ret < 0)
+			return ret;
+
+		rdata += used;
+		len += ret;
+	}
+
+	if (rdata + tail > end)
+		return -EINVAL;
+
+	if (len + tail > output_max)
+		return -ENOBUFS;
+
+	memcpy(output + len, rdata, tail);
+
+	return len + tail;
+}
+
 static int parse_rr(unsigned char *buf, unsigned char *start,
 			unsigned char *max,
 			unsigned char *response, unsigned int *response_size,
@@ -903,7 +2558,7 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 			char *name)
 {
 	struct domain_rr *rr;
-	int err, offset;
+	int err, offset, len;
 	int name_len = 0, output_len = 0, max_rsp = *response_size;
 
 	err = get_name(0, buf, start, max, response, max_rsp,
@@ -921,6 +2576,9 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 	if (!rr)
 		return -EINVAL;
 
+	if (*end + sizeof(struct domain_rr) > max)
+		return -ENOBUFS;
+
 	*type = ntohs(rr->type);
 	*class = ntohs(rr->class);
 	*ttl = ntohl(rr->ttl);
@@ -929,19 +2587,29 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 	if (*ttl < 0)
 		return -EINVAL;
 
+	if ((unsigned int) offset + sizeof(struct domain_rr) > *response_size)
+		return -ENOBUFS;
+
 	memcpy(response + offset, *end, sizeof(struct domain_rr));
 
 	offset += sizeof(struct domain_rr);
 	*end += sizeof(struct domain_rr);
 
-	if ((unsigned int) (offset + *rdlen) > *response_size)
+	if (*end + *rdlen > max)
 		return -ENOBUFS;
 
-	memcpy(response + offset, *end, *rdlen);
+	len = copy_rdata(buf, max, *type, *end, *rdlen, response + offset,
+						*response_size - offset);
+	if (len < 0)
+		return len;
+
+	/* The rdata length changes if there were names to uncompress */
+	rr = (void *) (response + offset - sizeof(struct domain_rr));
+	rr->rdlen = htons(len);
 
 	*end += *rdlen;
 
-	*response_size = offset + *rdlen;
+	*response_size = offset + len;
 
 	return 0;
 }
@@ -996,44 +2664,42 @@ static int parse_response(unsigned char *buf, int buflen,
 
 	q = (void *) ptr;
 	qtype = ntohs(q->type);
+	qclass = ntohs(q->class);
 
-	/* We cache only A and AAAA records */
-	if (qtype != 1 && qtype != 28)
-		return -ENOMSG;
+	*type = qtype;
+	*class = qclass;
 
-	qclass = ntohs(q->class);
+	if (!cache_type_supported(qtype))
+		return -ENOMSG;
 
 	ptr += 2 + 2; /* ptr points now to answers */
 
 	err = -ENOMSG;
 	*response_len = 0;
 	*answers = 0;
+	*ttl = 0;
 
 	memset(name, 0, sizeof(name));
 
 	/*
 	 * We have a bunch of answers (like A, AAAA, CNAME etc) to
-	 * A or AAAA question. We traverse the answers and parse the
-	 * resource records. Only A and AAAA records are cached, all
-	 * the other records in answers are skipped.
+	 * the question. We traverse the answers and parse the
+	 * resource records. Only the records of the question type
+	 * are cached, all the other records in answers are skipped.
 	 */
 	for (i = 0; i < ancount; i++) {
 		/*
-		 * Get one address at a time to this buffer.
-		 * The max size of the answer is
-		 *   2 (pointer) + 2 (type) + 2 (class) +
-		 *   4 (ttl) + 2 (rdlen) + addr (16 or 4) = 28
-		 * for A or AAAA record.
-		 * For CNAME the size can be bigger.
+		 * The record is parsed directly to the end of the
+		 * response buffer and only kept there if it answers
+		 * the question.
 		 */
-		unsigned char rsp[NS_MAXCDNAME];
-		unsigned int rsp_len = sizeof(rsp) - 1;
-		int ret, rdlen;
-
-		memset(rsp, 0, sizeof(rsp));
+		unsigned char *rsp = response + *response_len;
+		unsigned int rsp_len = maxlen - *response_len;
+		uint16_t rtype, rclass;
+		int ret, rdlen, rttl;
 
 		ret = parse_rr(buf, ptr, buf + buflen, rsp, &rsp_len,
-			type, class, ttl, &rdlen, &next, name);
+			&rtype, &rclass, &rttl, &rdlen, &next, name);
 		if (ret != 0) {
 			err = ret;
 			goto out;
@@ -1051,7 +2717,7 @@ static int parse_response(unsigned char *buf, int buflen,
 		 * Go to next answer if the class is not the one we are
 		 * looking for.
 		 */
-		if (*class != qclass) {
+		if (rclass != qclass) {
 			ptr = next;
 			next = NULL;
 			continue;
@@ -1077,21 +2743,23 @@ static int parse_response(unsigned char *buf, int buflen,
 		 * says ipv6.google.com has address xxx which is in fact the
 		 * address of ipv6.l.google.com. For caching purposes this
 		 * should not cause any issues.
+		 *
+		 * If the client asked for the CNAME itself, then the record
+		 * is the answer and it is cached as any other type.
 		 */
-		if (*type == 5 && strncmp(question, name, qlen) == 0) {
+		if (rtype == ns_t_cname && qtype != ns_t_cname &&
+				(check_alias(aliases, name) ||
+				strncmp(question, name, qlen) == 0)) {
 			/*
 			 * So now the alias answered the question. This is
 			 * not very useful from caching point of view as
-			 * the following A or AAAA records will not match the
-			 * question. We need to find the real A/AAAA record
+			 * the following records will not match the
+			 * question. We need to find the real record
 			 * of the alias and cache that.
 			 */
 			unsigned char *end = NULL;
 			int name_len = 0, output_len = 0;
 
-			memset(rsp, 0, sizeof(rsp));
-			rsp_len = sizeof(rsp) - 1;
-
 			/*
 			 * Alias is in rdata part of the message,
 			 * and next-rdlen points to it. So we need to get
@@ -1111,7 +2779,7 @@ static int parse_response(unsigned char *buf, int buflen,
 			 * We should now have the alias of the entry we might
 			 * want to cache. Just remember it for a while.
 			 * We check the alias list when we have parsed the
-			 * A or AAAA record.
+			 * record of the question type.
 			 */
 			aliases = g_slist_prepend(aliases, g_strdup(name));
 
@@ -1120,26 +2788,26 @@ static int parse_response(unsigned char *buf, int buflen,
 			continue;
 		}
 
-		if (*type == qtype) {
+		if (rtype == qtype) {
 			/*
-			 * We found correct type (A or AAAA)
+			 * We found correct type
 			 */
 			if (check_alias(aliases, name) ||
 				(!aliases && strncmp(question, name,
 							qlen) == 0)) {
 				/*
 				 * We found an alias or the name of the rr
-				 * matches the question. If so, we append
-				 * the compressed label to the cache.
+				 * matches the question. If so, we keep
+				 * the compressed label in the response.
 				 * The end result is a response buffer that
 				 * will contain one or more cached and
-				 * compressed resource records.
+				 * compressed resource records. The lowest
+				 * TTL of the records is used for the whole
+				 * set.
 				 */
-				if (*response_len + rsp_len > maxlen) {
-					err = -ENOBUFS;
-					goto out;
-				}
-				memcpy(response + *response_len, rsp, rsp_len);
+				if (*answers == 0 || rttl < *ttl)
+					*ttl = rttl;
+
 				*response_len += rsp_len;
 				(*answers)++;
 				err = 0;
@@ -1158,97 +2826,90 @@ out:
 	return err;
 }
 
-struct cache_timeout {
-	time_t current_time;
-	int max_timeout;
-	int try_harder;
-};
-
-static gboolean cache_check_entry(gpointer key, gpointer value,
-					gpointer user_data)
+/*
+ * Parse a negative answer (NXDOMAIN or NODATA) that has no answer
+ * records. The SOA record of the authority section is copied to the
+ * response buffer, and the negative TTL is the smaller one of the
+ * SOA record TTL and the SOA MINIMUM field (RFC 2308, section 5).
+ */
+static int parse_negative_response(unsigned char *buf, int buflen,
+				uint16_t qclass, int *ttl,
+				unsigned char *response,
+				unsigned int *response_len)
 {
-	struct cache_timeout *data = user_data;
-	struct cache_entry *entry = value;
-	int max_timeout;
+	struct domain_hdr *hdr = (void *) buf;
+	uint16_t nscount = ntohs(hdr->nscount);
+	unsigned char *ptr, *max = buf + buflen;
+	unsigned char *next = NULL;
+	unsigned int maxlen = *response_len;
+	char name[NS_MAXDNAME + 1];
+	int ret, i;
 
-	/* Scale the number of hits by half as part of cache aging */
+	if (buflen < 12 || hdr->ancount != 0)
+		return -EINVAL;
 
-	entry->hits /= 2;
+	ptr = buf + sizeof(struct domain_hdr);
 
-	/*
-	 * If either IPv4 or IPv6 cached entry has expired, we
-	 * remove both from the cache.
-	 */
+	/* skip the question, which is a name and 2 16 bit words */
+	ret = dn_skipname(ptr, max);
+	if (ret < 0 || ptr + ret + 4 > max)
+		return -EINVAL;
 
-	if (entry->ipv4 && entry->ipv4->timeout > 0) {
-		max_timeout = entry->ipv4->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+	ptr += ret + 4;
 
-		if (entry->ipv4->cache_until < data->current_time)
-			return TRUE;
-	}
+	for (i = 0; i < nscount; i++) {
+		unsigned int rsp_len = maxlen;
+		unsigned char owner[NS_MAXCDNAME];
+		unsigned char *rr = ptr;
+		uint16_t rtype, rclass;
+		uint32_t minimum;
+		int rdlen, rttl, owner_len, used, prefix;
 
-	if (entry->ipv6 && entry->ipv6->timeout > 0) {
-		max_timeout = entry->ipv6->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+		ret = parse_rr(buf, ptr, max, response, &rsp_len,
+				&rtype, &rclass, &rttl, &rdlen, &next, name);
+		if (ret < 0)
+			return ret;
 
-		if (entry->ipv6->cache_until < data->current_time)
-			return TRUE;
-	}
+		ptr = next;
+		next = NULL;
 
-	/*
-	 * if we're asked to try harder, also remove entries that have
-	 * few hits
-	 */
-	if (data->try_harder && entry->hits < 4)
-		return TRUE;
+		if (rtype != ns_t_soa || rclass != qclass)
+			continue;
 
-	return FALSE;
-}
+		/*
+		 * parse_rr() points the owner name at the question (or
+		 * leaves it out for the root), but the owner of the SOA
+		 * is the zone apex. Store it uncompressed instead.
+		 */
+		prefix = (response[0] & NS_CMPRSFLGS) == NS_CMPRSFLGS ? 2 : 0;
 
-static void cache_cleanup(void)
-{
-	static int max_timeout;
-	struct cache_timeout data;
-	int count = 0;
+		owner_len = copy_name(buf, max, rr, owner, sizeof(owner),
+								&used);
+		if (owner_len < 0)
+			return owner_len;
 
-	data.current_time = time(NULL);
-	data.max_timeout = 0;
-	data.try_harder = 0;
+		if (rsp_len - prefix + owner_len > maxlen)
+			return -ENOBUFS;
 
-	/*
-	 * In the first pass, we only remove entries that have timed out.
-	 * We use a cache of the first time to expire to do this only
-	 * when it makes sense.
-	 */
-	if (max_timeout <= data.current_time) {
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
-	}
-	debug("removed %d in the first pass", count);
+		memmove(response + owner_len, response + prefix,
+							rsp_len - prefix);
+		memcpy(response, owner, owner_len);
+		rsp_len += owner_len - prefix;
 
-	/*
-	 * In the second pass, if the first pass turned up blank,
-	 * we also expire entries with a low hit count,
-	 * while aging the hit count at the same time.
-	 */
-	data.try_harder = 1;
-	if (count == 0)
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
+		/* MINIMUM is the last field of the SOA rdata */
+		memcpy(&minimum, response + rsp_len - 4, sizeof(minimum));
+		minimum = ntohl(minimum);
 
-	if (count == 0)
-		/*
-		 * If we could not remove anything, then remember
-		 * what is the max timeout and do nothing if we
-		 * have not yet reached it. This will prevent
-		 * constant traversal of the cache if it is full.
-		 */
-		max_timeout = data.max_timeout;
-	else
-		max_timeout = 0;
+		*ttl = rttl;
+		if (minimum < (uint32_t) rttl)
+			*ttl = minimum;
+
+		*response_len = rsp_len;
+
+		return 0;
+	}
+
+	return -ENOMSG;
 }
 
 static gboolean cache_invalidate_entry(gpointer key, gpointer value,
@@ -1260,24 +2921,25 @@ static gboolean cache_invalidate_entry(gpointer key, gpointer value,
 	cache_enforce_validity(entry);
 
 	/* if anything is not expired, mark the entry for refresh */
-	if (entry->hits > 0 && (entry->ipv4 || entry->ipv6))
+	if (entry->hits > 0 && cache_entry_is_host(entry))
 		entry->want_refresh = true;
 
-	/* delete the cached data */
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
-	}
+	/*
+	 * delete the cached data, or keep it for serve-stale in case the
+	 * new servers do not answer
+	 */
+	while (entry->records) {
+		struct cache_data *data = entry->records->data;
 
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
+		entry->records = g_slist_delete_link(entry->records,
+							entry->records);
+		cache_entry_expire(entry, data);
 	}
 
+	cache_entry_resize(entry);
+
 	/* keep the entry if we want it refreshed, delete it otherwise */
-	if (entry->want_refresh)
+	if (entry->want_refresh || entry->stale)
 		return FALSE;
 	else
 		return TRUE;
@@ -1299,30 +2961,38 @@ static void cache_invalidate(void)
 	g_hash_table_foreach_remove(cache, cache_invalidate_entry, NULL);
 }
 
+/* turn a DNS name into a hostname with dots */
+static void cache_key_to_name(const char *key, char *name)
+{
+	char *c;
+
+	strncpy(name, key, NS_MAXDNAME);
+	name[NS_MAXDNAME] = '\0';
+
+	c = name;
+	while (c && *c) {
+		int jump;
+		jump = *c;
+		*c = '.';
+		c += jump + 1;
+	}
+}
+
 static void cache_refresh_entry(struct cache_entry *entry)
 {
 
 	cache_enforce_validity(entry);
 
-	if (entry->hits > 2 && !entry->ipv4)
-		entry->want_refresh = true;
-	if (entry->hits > 2 && !entry->ipv6)
+	if (entry->hits > 2 && cache_entry_is_host(entry) &&
+			(!cache_entry_get(entry, ns_t_a, ns_c_in) ||
+			!cache_entry_get(entry, ns_t_aaaa, ns_c_in)))
 		entry->want_refresh = true;
 
 	if (entry->want_refresh) {
-		char *c;
 		char dns_name[NS_MAXDNAME + 1];
 		entry->want_refresh = false;
 
-		/* turn a DNS name into a hostname with dots */
-		strncpy(dns_name, entry->key, NS_MAXDNAME);
-		c = dns_name;
-		while (c && *c) {
-			int jump;
-			jump = *c;
-			*c = '.';
-			c += jump + 1;
-		}
+		cache_key_to_name(entry->key, dns_name);
 		debug("Refreshing %s\n", dns_name);
 		/* then refresh the hostname */
 		refresh_dns_entry(entry, &dns_name[1]);
@@ -1367,27 +3037,25 @@ static int reply_query_type(unsigned char *msg, int len)
 }
 
 static int cache_update(struct server_data *srv, unsigned char *msg,
-			unsigned int msg_len)
+			unsigned int msg_len, bool replace)
 {
 	int offset = protocol_offset(srv->protocol);
 	int err, qlen, ttl = 0;
-	uint16_t answers = 0, type = 0, class = 0;
+	uint16_t answers = 0, authority = 0, type = 0, class = 0;
 	struct domain_hdr *hdr = (void *)(msg + offset);
 	struct domain_question *q;
 	struct cache_entry *entry;
 	struct cache_data *data;
 	char question[NS_MAXDNAME + 1];
-	unsigned char response[NS_MAXDNAME + 1];
+	unsigned char response[TCP_MAX_BUF_LEN];
 	unsigned char *ptr;
 	unsigned int rsplen;
-	bool new_entry = true;
+	bool new_entry = true, negative = false;
 	time_t current_time;
+	unsigned int data_len;
 
-	if (cache_size >= MAX_CACHE_SIZE) {
-		cache_cleanup();
-		if (cache_size >= MAX_CACHE_SIZE)
-			return 0;
-	}
+	if (cache_max_mem == 0)
+		return 0;
 
 	current_time = time(NULL);
 
@@ -1402,8 +3070,12 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 
 	debug("offset %d hdr %p msg %p rcode %d", offset, hdr, msg, hdr->rcode);
 
-	/* Continue only if response code is 0 (=ok) */
-	if (hdr->rcode != ns_r_noerror)
+	/*
+	 * Continue only if response code is 0 (=ok), or if the name
+	 * does not exist and the answer can be cached as negative.
+	 */
+	if (hdr->rcode != ns_r_noerror &&
+			(hdr->rcode != ns_r_nxdomain || negative_max_ttl == 0))
 		return 0;
 
 	if (!cache)
@@ -1417,6 +3089,26 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 				&type, &class, &ttl,
 				response, &rsplen, &answers);
 
+	/*
+	 * The name or the record type does not exist. If the server
+	 * gave us the SOA record of the zone, the answer is cached
+	 * as a negative one (RFC 2308).
+	 */
+	if (err == -ENOMSG && hdr->ancount == 0 && negative_max_ttl > 0 &&
+				cache_type_supported(type)) {
+		rsplen = sizeof(response) - 1;
+
+		if (parse_negative_response(msg + offset, msg_len - offset,
+					class, &ttl, response, &rsplen) == 0) {
+			negative = true;
+			authority = 1;
+			err = 0;
+		}
+	}
+
+	if (hdr->rcode != ns_r_noerror && !negative)
+		return 0;
+
 	/*
 	 * special case: if we do a ipv6 lookup and get no result
 	 * for a record that's already in our ipv4 cache.. we want
@@ -1425,29 +3117,44 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	if ((err == -ENOMSG || err == -ENOBUFS) &&
 			reply_query_type(msg + offset,
 					msg_len - offset) == 28) {
+		struct cache_data *ipv4;
+
+		data_len = sizeof(GSList) + sizeof(*data) + msg_len + 2;
+		if (data_len > cache_max_mem)
+			return 0;
+
+		cache_evict(data_len);
+
 		entry = g_hash_table_lookup(cache, question);
-		if (entry && entry->ipv4 && !entry->ipv6) {
+		if (!entry)
+			return 0;
+
+		ipv4 = cache_entry_get(entry, ns_t_a, ns_c_in);
+		if (ipv4 && !cache_entry_get(entry, ns_t_aaaa, ns_c_in)) {
 			int cache_offset = 0;
 
-			data = g_try_new(struct cache_data, 1);
+			data = pool_alloc(&cache_data_pool);
 			if (!data)
 				return -ENOMEM;
-			data->inserted = entry->ipv4->inserted;
-			data->type = type;
+			data->inserted = ipv4->inserted;
+			data->type = ns_t_aaaa;
+			data->class = ns_c_in;
 			data->answers = ntohs(hdr->ancount);
-			data->timeout = entry->ipv4->timeout;
+			data->timeout = ipv4->timeout;
 			if (srv->protocol == IPPROTO_UDP)
 				cache_offset = 2;
 			data->data_len = msg_len + cache_offset;
-			data->data = ptr = g_malloc(data->data_len);
+			data->data = ptr = cache_data_buffer(data);
 			ptr[0] = (data->data_len - 2) / 256;
 			ptr[1] = (data->data_len - 2) - ptr[0] * 256;
 			if (srv->protocol == IPPROTO_UDP)
 				ptr += 2;
-			data->valid_until = entry->ipv4->valid_until;
-			data->cache_until = entry->ipv4->cache_until;
+			data->valid_until = ipv4->valid_until;
+			data->cache_until = ipv4->cache_until;
 			memcpy(ptr, msg, msg_len);
-			entry->ipv6 = data;
+			cache_data_index_ttl(data);
+			entry->records = g_slist_prepend(entry->records, data);
+			cache_entry_resize(entry);
 			/*
 			 * we will get a "hit" when we serve the response
 			 * out of the cache
@@ -1464,67 +3171,92 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 
 	qlen = strlen(question);
 
+	/*
+	 * Evict cold entries before looking up the entry so that
+	 * the eviction cannot free the entry we are about to update.
+	 */
+	data_len = sizeof(*entry) + qlen + 1 + sizeof(GSList) +
+			sizeof(*data) + 2 + 12 + qlen + 1 + 2 + 2 + rsplen;
+	if (data_len > cache_max_mem)
+		return 0;
+
+	cache_evict(data_len);
+
 	/*
 	 * If the cache contains already data, check if the
 	 * type of the cached data is the same and do not add
 	 * to cache if data is already there.
-	 * This is needed so that we can cache both A and AAAA
-	 * records for the same name.
+	 * This is needed so that we can cache records of
+	 * several types (e.g. A and AAAA) for the same name.
 	 */
 	entry = g_hash_table_lookup(cache, question);
 	if (!entry) {
-		entry = g_try_new(struct cache_entry, 1);
+		entry = pool_alloc(&cache_entry_pool);
 		if (!entry)
 			return -ENOMEM;
 
-		data = g_try_new(struct cache_data, 1);
+		data = pool_alloc(&cache_data_pool);
 		if (!data) {
-			g_free(entry);
+			pool_free(&cache_entry_pool, entry);
 			return -ENOMEM;
 		}
 
 		entry->key = g_strdup(question);
-		entry->ipv4 = entry->ipv6 = NULL;
+		entry->records = NULL;
+		entry->stale = NULL;
 		entry->want_refresh = false;
 		entry->hits = 0;
+		entry->size = 0;
+		entry->lru_link = NULL;
 
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
+		entry->records = g_slist_prepend(entry->records, data);
 	} else {
-		if (type == 1 && entry->ipv4)
-			return 0;
+		struct cache_data *old = cache_entry_get(entry, type, class);
 
-		if (type == 28 && entry->ipv6)
+		/* a prefetch replaces the data it was sent for */
+		if (old && !replace)
 			return 0;
 
-		data = g_try_new(struct cache_data, 1);
+		data = pool_alloc(&cache_data_pool);
 		if (!data)
 			return -ENOMEM;
 
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
+		if (old) {
+			entry->records = g_slist_remove(entry->records, old);
+			cache_data_free(old);
+		}
+
+		entry->records = g_slist_prepend(entry->records, data);
 
 		/*
 		 * compensate for the hit we'll get for serving
 		 * the response out of the cache
 		 */
-		entry->hits--;
-		if (entry->hits < 0)
-			entry->hits = 0;
+		if (!replace) {
+			entry->hits--;
+			if (entry->hits < 0)
+				entry->hits = 0;
+		}
 
 		new_entry = false;
 	}
 
-	if (ttl < MIN_CACHE_TTL)
+	/*
+	 * Negative answers are kept only for the time the zone allows,
+	 * they are not stretched to the minimum TTL.
+	 */
+	if (negative) {
+		if ((unsigned int) ttl > negative_max_ttl)
+			ttl = negative_max_ttl;
+	} else if (ttl < MIN_CACHE_TTL)
 		ttl = MIN_CACHE_TTL;
 
 	data->inserted = current_time;
 	data->type = type;
+	data->class = class;
+	data->rcode = hdr->rcode;
 	data->answers = answers;
+	data->authority = authority;
 	data->timeout = ttl;
 	/*
 	 * The "2" in start of the length is the TCP offset. We allocate it
@@ -1532,7 +3264,7 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	 * of cached packet.
 	 */
 	data->data_len = 2 + 12 + qlen + 1 + 2 + 2 + rsplen;
-	data->data = ptr = g_malloc(data->data_len);
+	data->data = ptr = cache_data_buffer(data);
 	data->valid_until = current_time + ttl;
 
 	/*
@@ -1545,9 +3277,12 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	data->cache_until = round_down_ttl(current_time + ttl, ttl);
 
 	if (!data->data) {
-		g_free(entry->key);
-		g_free(data);
-		g_free(entry);
+		entry->records = g_slist_remove(entry->records, data);
+		pool_free(&cache_data_pool, data);
+		if (new_entry) {
+			g_free(entry->key);
+			pool_free(&cache_entry_pool, entry);
+		}
 		return -ENOMEM;
 	}
 
@@ -1575,16 +3310,28 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	memcpy(ptr + offset + 12 + qlen + 1 + sizeof(struct domain_question),
 		response, rsplen);
 
+	cache_data_index_ttl(data);
+
 	if (new_entry) {
 		g_hash_table_replace(cache, entry->key, entry);
+		g_queue_push_head(&cache_lru, entry);
+		entry->lru_link = g_queue_peek_head_link(&cache_lru);
 		cache_size++;
-	}
+	} else
+		cache_entry_drop_stale(entry, type, class);
+
+	cache_entry_resize(entry);
+	cache_snapshot_dirty = true;
+
+	if (negative)
+		proxy_stats.negative_inserts++;
 
-	debug("cache %d %squestion \"%s\" type %d ttl %d size %zd packet %u "
-								"dns len %u",
-		cache_size, new_entry ? "new " : "old ",
-		question, type, ttl,
-		sizeof(*entry) + sizeof(*data) + data->data_len + qlen,
+	debug("cache %d mem %u/%u %s%squestion \"%s\" type %d ttl %d "
+					"size %u packet %u dns len %u",
+		cache_size, cache_mem, cache_max_mem,
+		new_entry ? "new " : "old ",
+		negative ? "negative " : "",
+		question, type, ttl, entry->size,
 		data->data_len,
 		srv->protocol == IPPROTO_TCP ?
 			(unsigned int)(data->data[0] * 256 + data->data[1]) :
@@ -1593,34 +3340,111 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	return 0;
 }
 
+/*
+ * Send the question of a cache entry to the servers. The reply is
+ * handled like any other reply, except that it replaces the cached
+ * data and is not forwarded anywhere.
+ */
+static void cache_prefetch(struct cache_entry *entry,
+				struct cache_data *data)
+{
+	struct request_data *req;
+	struct domain_hdr *hdr;
+	struct domain_question *q;
+	char name[NS_MAXDNAME + 1];
+	int keylen = strlen(entry->key) + 1;
+
+	req = pool_alloc(&request_pool);
+	if (!req)
+		return;
+
+	req->protocol = IPPROTO_UDP;
+	req->prefetch = true;
+	req->dstid = get_id();
+	req->altid = get_id();
+
+	cache_key_to_name(entry->key, name);
+	request_set_query(req, NULL, sizeof(struct domain_hdr) + keylen +
+				sizeof(struct domain_question), &name[1]);
+
+	hdr = req->request;
+	hdr->id = req->dstid;
+	hdr->rd = 1;
+	hdr->qdcount = htons(1);
+
+	memcpy(req->request + sizeof(struct domain_hdr), entry->key, keylen);
+
+	q = req->request + sizeof(struct domain_hdr) + keylen;
+	q->type = htons(data->type);
+	q->class = htons(data->class);
+
+	debug("Prefetching %s type %d", (char *) req->name, data->type);
+
+	/* set before sending, the request clears it when it is done */
+	data->prefetching = true;
+
+	resolv(req, req->request, req->name);
+
+	if (req->numserv == 0) {
+		destroy_request_data(req);
+		return;
+	}
+
+	request_timer_start(req, req->failover ? FAILOVER_TIMEOUT : 5);
+	request_add(req);
+}
+
+static void cache_prefetch_check(struct cache_entry *entry,
+				struct cache_data *data)
+{
+	time_t lifetime, expires;
+
+	if (prefetch_threshold == 0 || data->prefetching ||
+			data->answers == 0)
+		return;
+
+	if ((unsigned int) entry->hits < prefetch_threshold)
+		return;
+
+	expires = MIN(data->valid_until, data->cache_until);
+	lifetime = expires - data->inserted;
+
+	if (time(NULL) < data->inserted + lifetime * PREFETCH_PERCENT / 100)
+		return;
+
+	cache_prefetch(entry, data);
+}
+
 static int ns_resolv(struct server_data *server, struct request_data *req,
 				gpointer request, gpointer name)
 {
 	GList *list;
-	int sk, err, type = 0;
+	int sk, err;
 	char *dot, *lookup = (char *) name;
-	struct cache_entry *entry;
+	struct cache_entry *entry = NULL;
+	struct cache_data *data = NULL;
+
+	/* a prefetch is sent because the cached data is about to expire */
+	if (!req->prefetch)
+		entry = cache_check(request, &data, req->protocol);
 
-	entry = cache_check(request, &type, req->protocol);
 	if (entry) {
 		int ttl_left = 0;
-		struct cache_data *data;
 
-		debug("cache hit %s type %s", lookup, type == 1 ? "A" : "AAAA");
-		if (type == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		debug("cache hit %s type %d", lookup,
+					data ? data->type : 0);
 
 		if (data) {
 			ttl_left = data->valid_until - time(NULL);
 			entry->hits++;
+			proxy_stats.cache_hits++;
+			cache_prefetch_check(entry, data);
 		}
 
 		if (data && req->protocol == IPPROTO_TCP) {
-			send_cached_response(req->client_sk, data->data,
-					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+			send_cached_response(req->client_sk, data,
+					NULL, 0, IPPROTO_TCP, req->srcid,
+					ttl_left, 0);
 			return 1;
 		}
 
@@ -1630,10 +3454,9 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 			if (udp_sk < 0)
 				return -EIO;
 
-			send_cached_response(udp_sk, data->data,
-				data->data_len, &req->sa, req->sa_len,
-				IPPROTO_UDP, req->srcid, data->answers,
-				ttl_left);
+			send_cached_response(udp_sk, data,
+				&req->sa, req->sa_len, IPPROTO_UDP,
+				req->srcid, ttl_left, req->udp_size);
 			return 1;
 		}
 	}
@@ -1650,6 +3473,16 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 		return -EIO;
 	}
 
+	server_query_sent(server);
+
+	/* a prefetch has no listener, it goes the way of its server */
+	if (req->prefetch)
+		req->family = server->server_addr->sa_family;
+
+	if (server->protocol == IPPROTO_TCP)
+		server->pending = g_slist_prepend(server->pending,
+					GUINT_TO_POINTER(req->dstid));
+
 	req->numserv++;
 
 	/* If we have more than one dot, we don't add domains */
@@ -1918,6 +3751,34 @@ static int strip_domains(char *name, char *answers, int maxlen)
 	return end - start;
 }
 
+/* Send the reply of a request to the requests coalesced with it */
+static void request_answer_waiters(struct request_data *req)
+{
+	unsigned char *resp = req->resp;
+	GSList *list;
+	int sk;
+
+	for (list = req->waiters; resp && list; list = list->next) {
+		struct request_data *waiter = list->data;
+
+		sk = get_req_udp_socket(waiter);
+		if (sk < 0)
+			continue;
+
+		resp[0] = waiter->srcid & 0xff;
+		resp[1] = waiter->srcid >> 8;
+
+		if (sendto(sk, resp, req->resplen, MSG_NOSIGNAL,
+					&waiter->sa, waiter->sa_len) < 0)
+			debug("Cannot send msg, sk %d errno %d/%s", sk,
+						errno, strerror(errno));
+	}
+
+	g_slist_free_full(req->waiters,
+				(GDestroyNotify) destroy_request_data);
+	req->waiters = NULL;
+}
+
 static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 				struct server_data *data)
 {
@@ -1934,6 +3795,9 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 	debug("Received %d bytes (id 0x%04x)", reply_len, dns_id);
 
 	req = find_request(dns_id);
+
+	server_reply_received(data, req);
+
 	if (!req)
 		return -EINVAL;
 
@@ -1945,6 +3809,9 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 
 	req->numresp++;
 
+	if (hdr->tc)
+		proxy_stats.truncated_replies++;
+
 	if (hdr->rcode == ns_r_noerror || !req->resp) {
 		unsigned char *new_reply = NULL;
 
@@ -2117,7 +3984,7 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 		memcpy(req->resp, reply, reply_len);
 		req->resplen = reply_len;
 
-		cache_update(data, reply, reply_len);
+		cache_update(data, reply, reply_len, req->prefetch);
 
 		g_free(new_reply);
 	}
@@ -2131,7 +3998,13 @@ out:
 		}
 	}
 
-	request_list = g_slist_remove(request_list, req);
+	request_remove(req);
+
+	/* there is no client waiting for a prefetch */
+	if (req->prefetch) {
+		destroy_request_data(req);
+		return 0;
+	}
 
 	if (protocol == IPPROTO_UDP) {
 		sk = get_req_udp_socket(req);
@@ -2152,6 +4025,7 @@ out:
 	else
 		debug("proto %d sent %d bytes to %d", protocol, err, sk);
 
+	request_answer_waiters(req);
 	destroy_request_data(req);
 
 	return err;
@@ -2180,17 +4054,29 @@ static void server_destroy_socket(struct server_data *data)
 
 	g_free(data->incoming_reply);
 	data->incoming_reply = NULL;
+
+	g_slist_free(data->pending);
+	data->pending = NULL;
 }
 
 static void destroy_server(struct server_data *server)
 {
+	GList *list;
+
 	debug("index %d server %s sock %d", server->index, server->server,
 			server->channel ?
 			g_io_channel_unix_get_fd(server->channel): -1);
 
 	server_list = g_slist_remove(server_list, server);
+	tcp_connect_list = g_slist_remove(tcp_connect_list, server);
 	server_destroy_socket(server);
 
+	for (list = request_queue.head; list; list = list->next) {
+		struct request_data *req = list->data;
+
+		req->raced = g_slist_remove(req->raced, server);
+	}
+
 	if (server->protocol == IPPROTO_UDP && server->enabled)
 		debug("Removing DNS server %s", server->server);
 
@@ -2216,7 +4102,6 @@ static void destroy_server(struct server_data *server)
 static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
-	unsigned char buf[4096];
 	int sk, err, len;
 	struct server_data *data = user_data;
 
@@ -2228,17 +4113,60 @@ static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 
 	sk = g_io_channel_unix_get_fd(channel);
 
-	len = recv(sk, buf, sizeof(buf), 0);
+	len = recv(sk, udp_reply_buf, max_udp_size, 0);
 	if (len < 12)
 		return TRUE;
 
-	err = forward_dns_reply(buf, len, IPPROTO_UDP, data);
+	err = forward_dns_reply(udp_reply_buf, len, IPPROTO_UDP, data);
 	if (err < 0)
 		return TRUE;
 
 	return TRUE;
 }
 
+static gboolean tcp_idle_timeout(gpointer user_data)
+{
+	struct server_data *server = user_data;
+
+	debug("");
+
+	if (!server)
+		return FALSE;
+
+	server->timeout = 0;
+	destroy_server(server);
+
+	return FALSE;
+}
+
+static void tcp_server_set_timeout(struct server_data *server,
+						unsigned int seconds)
+{
+	if (server->timeout > 0)
+		g_source_remove(server->timeout);
+
+	server->timeout = g_timeout_add_seconds(seconds, tcp_idle_timeout,
+								server);
+}
+
+/*
+ * The idle timer only runs while no queries are outstanding on the
+ * connection, the requests have their own timeouts until then.
+ */
+static void tcp_server_touch(struct server_data *server)
+{
+	if (server->pending) {
+		if (server->timeout > 0) {
+			g_source_remove(server->timeout);
+			server->timeout = 0;
+		}
+		return;
+	}
+
+	tcp_server_set_timeout(server, tcp_idle_time ?
+					tcp_idle_time : TCP_CONNECT_TIMEOUT);
+}
+
 static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
@@ -2261,13 +4189,12 @@ hangup:
 		g_free(server->incoming_reply);
 		server->incoming_reply = NULL;
 
-		list = request_list;
-		while (list) {
-			struct request_data *req = list->data;
+		for (list = server->pending; list; list = list->next) {
+			struct request_data *req;
 			struct domain_hdr *hdr;
-			list = list->next;
 
-			if (req->protocol == IPPROTO_UDP)
+			req = find_request(GPOINTER_TO_UINT(list->data));
+			if (!req || req->protocol == IPPROTO_UDP)
 				continue;
 
 			if (!req->request)
@@ -2286,7 +4213,7 @@ hangup:
 			send_response(req->client_sk, req->request,
 				req->request_len, NULL, 0, IPPROTO_TCP);
 
-			request_list = g_slist_remove(request_list, req);
+			request_remove(req);
 		}
 
 		destroy_server(server);
@@ -2295,8 +4222,7 @@ hangup:
 	}
 
 	if ((condition & G_IO_OUT) && !server->connected) {
-		GSList *list;
-		GList *domains;
+		GList *list, *domains;
 		bool no_request_sent = true;
 		struct server_data *udp_server;
 
@@ -2316,6 +4242,7 @@ hangup:
 		}
 
 		server->connected = true;
+		tcp_connect_list = g_slist_remove(tcp_connect_list, server);
 		server_list = g_slist_append(server_list, server);
 
 		if (server->timeout > 0) {
@@ -2323,7 +4250,7 @@ hangup:
 			server->timeout = 0;
 		}
 
-		for (list = request_list; list; ) {
+		for (list = request_queue.head; list; ) {
 			struct request_data *req = list->data;
 			int status;
 
@@ -2342,7 +4269,6 @@ hangup:
 				 * so the request can be released
 				 */
 				list = list->next;
-				request_list = g_slist_remove(request_list, req);
 				destroy_request_data(req);
 				continue;
 			}
@@ -2354,11 +4280,7 @@ hangup:
 
 			no_request_sent = false;
 
-			if (req->timeout > 0)
-				g_source_remove(req->timeout);
-
-			req->timeout = g_timeout_add_seconds(30,
-						request_timeout, req);
+			request_timer_start(req, 30);
 			list = list->next;
 		}
 
@@ -2367,85 +4289,106 @@ hangup:
 			return FALSE;
 		}
 
+		tcp_server_touch(server);
+
+		/*
+		 * The socket stays writable from now on, so only wait
+		 * for replies on the connection.
+		 */
+		server->watch = g_io_add_watch(server->channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						tcp_server_event, server);
+		return FALSE;
+
 	} else if (condition & G_IO_IN) {
-		struct partial_reply *reply = server->incoming_reply;
-		int bytes_recv;
-
-		if (!reply) {
-			unsigned char reply_len_buf[2];
-			uint16_t reply_len;
-
-			bytes_recv = recv(sk, reply_len_buf, 2, MSG_PEEK);
-			if (!bytes_recv) {
-				goto hangup;
-			} else if (bytes_recv < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
+		/* several replies may be waiting on a pipelined connection */
+		while (true) {
+			struct partial_reply *reply = server->incoming_reply;
+			struct request_data *req;
+			int bytes_recv;
+			guint16 id;
+
+			if (!reply) {
+				unsigned char reply_len_buf[2];
+				uint16_t reply_len;
+
+				bytes_recv = recv(sk, reply_len_buf, 2,
+								MSG_PEEK);
+				if (!bytes_recv) {
+					goto hangup;
+				} else if (bytes_recv < 0) {
+					if (errno == EAGAIN ||
+							errno == EWOULDBLOCK)
+						return TRUE;
+
+					connman_error("DNS proxy error %s",
+							strerror(errno));
+					goto hangup;
+				} else if (bytes_recv < 2)
 					return TRUE;
 
-				connman_error("DNS proxy error %s",
-						strerror(errno));
-				goto hangup;
-			} else if (bytes_recv < 2)
-				return TRUE;
-
-			reply_len = reply_len_buf[1] | reply_len_buf[0] << 8;
-			reply_len += 2;
+				reply_len = reply_len_buf[1] |
+						reply_len_buf[0] << 8;
+				reply_len += 2;
 
-			debug("TCP reply %d bytes from %d", reply_len, sk);
+				debug("TCP reply %d bytes from %d",
+							reply_len, sk);
 
-			reply = g_try_malloc(sizeof(*reply) + reply_len + 2);
-			if (!reply)
-				return TRUE;
+				reply = g_try_malloc(sizeof(*reply) +
+							reply_len + 2);
+				if (!reply)
+					return TRUE;
 
-			reply->len = reply_len;
-			reply->received = 0;
+				reply->len = reply_len;
+				reply->received = 0;
 
-			server->incoming_reply = reply;
-		}
+				server->incoming_reply = reply;
+			}
 
-		while (reply->received < reply->len) {
-			bytes_recv = recv(sk, reply->buf + reply->received,
+			while (reply->received < reply->len) {
+				bytes_recv = recv(sk,
+					reply->buf + reply->received,
 					reply->len - reply->received, 0);
-			if (!bytes_recv) {
-				connman_error("DNS proxy TCP disconnect");
-				break;
-			} else if (bytes_recv < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					return TRUE;
-
-				connman_error("DNS proxy error %s",
-						strerror(errno));
-				break;
+				if (!bytes_recv) {
+					connman_error("DNS proxy TCP "
+							"disconnect");
+					goto hangup;
+				} else if (bytes_recv < 0) {
+					if (errno == EAGAIN ||
+							errno == EWOULDBLOCK)
+						return TRUE;
+
+					connman_error("DNS proxy error %s",
+							strerror(errno));
+					goto hangup;
+				}
+				reply->received += bytes_recv;
 			}
-			reply->received += bytes_recv;
-		}
-
-		forward_dns_reply(reply->buf, reply->received, IPPROTO_TCP,
-					server);
-
-		g_free(reply);
-		server->incoming_reply = NULL;
 
-		destroy_server(server);
-
-		return FALSE;
-	}
+			id = reply->buf[2] | reply->buf[3] << 8;
+			req = find_request(id);
+			if (req)
+				id = req->dstid;
 
-	return TRUE;
-}
+			forward_dns_reply(reply->buf, reply->received,
+						IPPROTO_TCP, server);
 
-static gboolean tcp_idle_timeout(gpointer user_data)
-{
-	struct server_data *server = user_data;
+			g_free(reply);
+			server->incoming_reply = NULL;
 
-	debug("");
+			server->pending = g_slist_remove(server->pending,
+							GUINT_TO_POINTER(id));
 
-	if (!server)
-		return FALSE;
+			if (tcp_idle_time == 0 && !server->pending) {
+				destroy_server(server);
+				return FALSE;
+			}
 
-	destroy_server(server);
+			tcp_server_touch(server);
+		}
+	}
 
-	return FALSE;
+	return TRUE;
 }
 
 static int server_create_socket(struct server_data *data)
@@ -2502,8 +4445,7 @@ static int server_create_socket(struct server_data *data)
 		data->watch = g_io_add_watch(data->channel,
 			G_IO_OUT | G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
 						tcp_server_event, data);
-		data->timeout = g_timeout_add_seconds(30, tcp_idle_timeout,
-								data);
+		tcp_server_set_timeout(data, TCP_CONNECT_TIMEOUT);
 	} else
 		data->watch = g_io_add_watch(data->channel,
 			G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
@@ -2637,7 +4579,8 @@ static struct server_data *create_server(int index,
 		}
 
 		server_list = g_slist_append(server_list, data);
-	}
+	} else
+		tcp_connect_list = g_slist_prepend(tcp_connect_list, data);
 
 	return data;
 }
@@ -2645,7 +4588,9 @@ static struct server_data *create_server(int index,
 static bool resolv(struct request_data *req,
 				gpointer request, gpointer name)
 {
-	GSList *list;
+	GSList *list, *servers = NULL;
+	unsigned int sent = 0;
+	bool found = false;
 
 	for (list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
@@ -2667,11 +4612,47 @@ static bool resolv(struct request_data *req,
 			}
 		}
 
-		if (ns_resolv(data, req, request, name) > 0)
-			return true;
+		servers = g_slist_insert_sorted(servers, data, server_compare);
 	}
 
-	return false;
+	if (!req->retransmit)
+		req->sent = monotonic_ms();
+
+	for (list = servers; list; list = list->next) {
+		struct server_data *data = list->data;
+		int status;
+
+		if (!req->retransmit && race_servers > 0 &&
+						sent >= race_servers) {
+			req->failover = true;
+			break;
+		}
+
+		/* the raced servers already have the query */
+		if (req->retransmit && g_slist_find(req->raced, data))
+			continue;
+
+		debug("server %s score %u", data->server,
+						server_score(data));
+
+		status = ns_resolv(data, req, request, name);
+		if (status > 0) {
+			found = true;
+			break;
+		}
+
+		if (status == 0) {
+			sent++;
+
+			if (!req->retransmit && race_servers > 0)
+				req->raced = g_slist_prepend(req->raced,
+								data);
+		}
+	}
+
+	g_slist_free(servers);
+
+	return found;
 }
 
 static void update_domain(int index, const char *domain, bool append)
@@ -2728,9 +4709,9 @@ static void remove_domain(int index, const char *domain)
 
 static void flush_requests(struct server_data *server)
 {
-	GSList *list;
+	GList *list;
 
-	list = request_list;
+	list = request_queue.head;
 	while (list) {
 		struct request_data *req = list->data;
 
@@ -2741,16 +4722,11 @@ static void flush_requests(struct server_data *server)
 			 * A cached result was sent,
 			 * so the request can be released
 			 */
-			request_list =
-				g_slist_remove(request_list, req);
 			destroy_request_data(req);
 			continue;
 		}
 
-		if (req->timeout > 0)
-			g_source_remove(req->timeout);
-
-		req->timeout = g_timeout_add_seconds(5, request_timeout, req);
+		request_timer_start(req, 5);
 	}
 }
 
@@ -2910,7 +4886,8 @@ static struct connman_notifier dnsproxy_notifier = {
 static unsigned char opt_edns0_type[2] = { 0x00, 0x29 };
 
 static int parse_request(unsigned char *buf, int len,
-					char *name, unsigned int size)
+					char *name, unsigned int size,
+					guint16 *udp_size)
 {
 	struct domain_hdr *hdr = (void *) buf;
 	uint16_t qdcount = ntohs(hdr->qdcount);
@@ -2929,6 +4906,9 @@ static int parse_request(unsigned char *buf, int len,
 	if (hdr->qr != 0 || qdcount != 1)
 		return -EINVAL;
 
+	if (udp_size)
+		*udp_size = DNS_UDP_SIZE;
+
 	name[0] = '\0';
 
 	ptr = buf + sizeof(struct domain_hdr);
@@ -2945,74 +4925,426 @@ static int parse_request(unsigned char *buf, int len,
 		if (used + label_len + 1 > size)
 			return -ENOBUFS;
 
-		strncat(name, (char *) (ptr + 1), label_len);
-		strcat(name, ".");
+		strncat(name, (char *) (ptr + 1), label_len);
+		strcat(name, ".");
+
+		used += label_len + 1;
+
+		ptr += label_len + 1;
+		remain -= label_len + 1;
+	}
+
+	if (last_label && arcount && remain >= 9 && last_label[4] == 0 &&
+				!memcmp(last_label + 5, opt_edns0_type, 2)) {
+		uint16_t edns0_bufsize;
+
+		edns0_bufsize = last_label[7] << 8 | last_label[8];
+
+		debug("EDNS0 buffer size %u", edns0_bufsize);
+
+		/*
+		 * The servers are asked for replies of the size the
+		 * client can take, as far as we can take them as well.
+		 */
+		edns0_bufsize = MAX(edns0_bufsize, DNS_UDP_SIZE);
+		edns0_bufsize = MIN(edns0_bufsize, max_udp_size);
+
+		last_label[7] = edns0_bufsize >> 8;
+		last_label[8] = edns0_bufsize & 0xff;
+
+		if (udp_size)
+			*udp_size = edns0_bufsize;
+	}
+
+	debug("query %s", name);
+
+	return 0;
+}
+
+static void client_reset(struct tcp_partial_client_data *client)
+{
+	if (!client)
+		return;
+
+	if (client->channel) {
+		debug("client %d closing",
+			g_io_channel_unix_get_fd(client->channel));
+
+		g_io_channel_unref(client->channel);
+		client->channel = NULL;
+	}
+
+	if (client->watch > 0) {
+		g_source_remove(client->watch);
+		client->watch = 0;
+	}
+
+	if (client->timeout > 0) {
+		g_source_remove(client->timeout);
+		client->timeout = 0;
+	}
+
+	g_free(client->buf);
+	client->buf = NULL;
+
+	client->buf_end = 0;
+}
+
+static unsigned int get_msg_len(unsigned char *buf)
+{
+	return buf[0]<<8 | buf[1];
+}
+
+/*
+ * Names from the hosts file in the configuration directory are
+ * answered directly, without asking the servers. The file has the
+ * format of /etc/hosts: an address followed by its names. Reverse
+ * lookups of the addresses return the first name of the line.
+ */
+#define HOSTS_FILE "hosts"
+#define HOSTS_TTL 60
+
+struct host_entry {
+	unsigned int count4;
+	unsigned int count6;
+	struct in_addr *addr4;
+	struct in6_addr *addr6;
+};
+
+static GHashTable *hosts_table; /* name -> struct host_entry */
+static GHashTable *hosts_reverse; /* reverse name -> name */
+
+static void host_entry_free(gpointer data)
+{
+	struct host_entry *entry = data;
+
+	g_free(entry->addr4);
+	g_free(entry->addr6);
+	g_free(entry);
+}
+
+static char *hosts_reverse_name(int family, const void *addr)
+{
+	const unsigned char *a = addr;
+	GString *str;
+	int i;
+
+	if (family == AF_INET)
+		return g_strdup_printf("%u.%u.%u.%u.in-addr.arpa",
+						a[3], a[2], a[1], a[0]);
+
+	str = g_string_sized_new(72);
+
+	for (i = 15; i >= 0; i--)
+		g_string_append_printf(str, "%x.%x.", a[i] & 0xf, a[i] >> 4);
+
+	g_string_append(str, "ip6.arpa");
+
+	return g_string_free(str, FALSE);
+}
+
+static void hosts_add(const char *name, int family, const void *addr,
+							bool first)
+{
+	struct host_entry *entry;
+	char *key;
+
+	key = g_ascii_strdown(name, -1);
+	if (g_str_has_suffix(key, "."))
+		key[strlen(key) - 1] = '\0';
+
+	if (key[0] == '\0' || strlen(key) > NS_MAXDNAME - 2) {
+		g_free(key);
+		return;
+	}
+
+	entry = g_hash_table_lookup(hosts_table, key);
+	if (!entry) {
+		entry = g_new0(struct host_entry, 1);
+		g_hash_table_replace(hosts_table, g_strdup(key), entry);
+	}
+
+	if (family == AF_INET) {
+		entry->addr4 = g_renew(struct in_addr, entry->addr4,
+							entry->count4 + 1);
+		memcpy(&entry->addr4[entry->count4++], addr,
+						sizeof(struct in_addr));
+	} else {
+		entry->addr6 = g_renew(struct in6_addr, entry->addr6,
+							entry->count6 + 1);
+		memcpy(&entry->addr6[entry->count6++], addr,
+						sizeof(struct in6_addr));
+	}
+
+	if (first) {
+		char *reverse = hosts_reverse_name(family, addr);
+
+		if (!g_hash_table_lookup(hosts_reverse, reverse))
+			g_hash_table_replace(hosts_reverse, reverse,
+							g_strdup(key));
+		else
+			g_free(reverse);
+	}
+
+	g_free(key);
+}
+
+static void hosts_load(void)
+{
+	char *contents = NULL;
+	char **lines;
+	int i;
+
+	g_hash_table_remove_all(hosts_table);
+	g_hash_table_remove_all(hosts_reverse);
+
+	if (!g_file_get_contents(CONFIGDIR "/" HOSTS_FILE, &contents,
+								NULL, NULL))
+		return;
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	for (i = 0; lines[i]; i++) {
+		struct in6_addr addr;
+		char **fields, *comment;
+		int family, j;
+
+		comment = strchr(lines[i], '#');
+		if (comment)
+			*comment = '\0';
+
+		fields = g_strsplit_set(g_strstrip(lines[i]), " \t", -1);
+
+		if (!fields[0] || fields[0][0] == '\0')
+			goto next;
+
+		if (inet_pton(AF_INET, fields[0], &addr) == 1)
+			family = AF_INET;
+		else if (inet_pton(AF_INET6, fields[0], &addr) == 1)
+			family = AF_INET6;
+		else {
+			connman_warn("Invalid address %s in %s", fields[0],
+							HOSTS_FILE);
+			goto next;
+		}
+
+		for (j = 1; fields[j]; j++) {
+			if (fields[j][0] == '\0')
+				continue;
+
+			hosts_add(fields[j], family, &addr, j == 1);
+		}
+
+	next:
+		g_strfreev(fields);
+	}
+
+	g_strfreev(lines);
+
+	DBG("%u local names", g_hash_table_size(hosts_table));
+}
+
+static void hosts_notify(struct inotify_event *event, const char *ident)
+{
+	if (!ident || !g_str_equal(ident, HOSTS_FILE))
+		return;
+
+	hosts_load();
+}
+
+/* Append a name in wire format, returns the number of bytes used */
+static int hosts_encode_name(const char *name, unsigned char *buf,
+							int size)
+{
+	const char *label = name;
+	int used = 0;
+
+	while (*label) {
+		const char *dot = strchr(label, '.');
+		int len = dot ? dot - label : (int) strlen(label);
+
+		if (len == 0 || len > 63 || used + len + 2 > size)
+			return -ENOBUFS;
+
+		buf[used++] = len;
+		memcpy(buf + used, label, len);
+		used += len;
+
+		label += len;
+		if (*label == '.')
+			label++;
+	}
+
+	buf[used++] = 0;
+
+	return used;
+}
+
+static int hosts_append_record(unsigned char *buf, int used, int size,
+				uint16_t type, const void *rdata,
+				uint16_t rdlen)
+{
+	struct domain_rr rr;
+
+	if (used + 2 + (int) sizeof(rr) + rdlen > size)
+		return -ENOBUFS;
+
+	/* the name is a pointer to the question */
+	buf[used++] = 0xc0;
+	buf[used++] = 12;
+
+	rr.type = htons(type);
+	rr.class = htons(ns_c_in);
+	rr.ttl = htonl(HOSTS_TTL);
+	rr.rdlen = htons(rdlen);
+
+	memcpy(buf + used, &rr, sizeof(rr));
+	used += sizeof(rr);
+
+	memcpy(buf + used, rdata, rdlen);
+
+	return used + rdlen;
+}
+
+/*
+ * Answer the query if it is for a local name. Returns true if an
+ * answer was sent.
+ */
+static bool hosts_answer(int sk, unsigned char *buf, int len,
+				const struct sockaddr *to, socklen_t tolen,
+				int protocol, unsigned int udp_size)
+{
+	unsigned char reply[TCP_MAX_BUF_LEN];
+	unsigned char *msg, *out;
+	char name[NS_MAXDNAME];
+	struct domain_hdr *hdr;
+	struct domain_question q;
+	struct host_entry *entry;
+	char *target = NULL;
+	int offset, pos, qlen, used, count = 0;
+	unsigned int i;
+
+	if (!hosts_table || g_hash_table_size(hosts_table) == 0)
+		return false;
+
+	offset = protocol_offset(protocol);
+	if (offset < 0 || len < offset + 12)
+		return false;
+
+	msg = buf + offset;
+	len -= offset;
+
+	/* the question as a lower case name without the final dot */
+	name[0] = '\0';
+	for (pos = 12; pos < len && msg[pos]; pos += msg[pos] + 1) {
+		int label_len = msg[pos];
 
-		used += label_len + 1;
+		if (label_len > 63 || pos + 1 + label_len >= len ||
+				strlen(name) + label_len + 2 > sizeof(name))
+			return false;
 
-		ptr += label_len + 1;
-		remain -= label_len + 1;
+		if (name[0])
+			strcat(name, ".");
+		strncat(name, (char *) msg + pos + 1, label_len);
 	}
 
-	if (last_label && arcount && remain >= 9 && last_label[4] == 0 &&
-				!memcmp(last_label + 5, opt_edns0_type, 2)) {
-		uint16_t edns0_bufsize;
+	if (pos + 1 + (int) sizeof(q) > len)
+		return false;
 
-		edns0_bufsize = last_label[7] << 8 | last_label[8];
+	memcpy(&q, msg + pos + 1, sizeof(q));
+	if (ntohs(q.class) != ns_c_in)
+		return false;
 
-		debug("EDNS0 buffer size %u", edns0_bufsize);
+	for (i = 0; name[i]; i++)
+		name[i] = g_ascii_tolower(name[i]);
 
-		/* This is an evil hack until full TCP support has been
-		 * implemented.
-		 *
-		 * Somtimes the EDNS0 request gets send with a too-small
-		 * buffer size. Since glibc doesn't seem to crash when it
-		 * gets a response biffer then it requested, just bump
-		 * the buffer size up to 4KiB.
-		 */
-		if (edns0_bufsize < 0x1000) {
-			last_label[7] = 0x10;
-			last_label[8] = 0x00;
+	entry = g_hash_table_lookup(hosts_table, name);
+	if (!entry) {
+		target = g_hash_table_lookup(hosts_reverse, name);
+		if (!target)
+			return false;
+	}
+
+	/* header and question of the query */
+	qlen = pos + 1 + sizeof(q);
+	if (qlen > (int) sizeof(reply) - 2)
+		return false;
+
+	used = qlen;
+
+	out = reply + 2;
+	memcpy(out, msg, used);
+
+	if (entry && ntohs(q.type) == ns_t_a) {
+		for (i = 0; i < entry->count4 && used > 0; i++, count++)
+			used = hosts_append_record(out, used,
+					sizeof(reply) - 2, ns_t_a,
+					&entry->addr4[i],
+					sizeof(struct in_addr));
+	} else if (entry && ntohs(q.type) == ns_t_aaaa) {
+		for (i = 0; i < entry->count6 && used > 0; i++, count++)
+			used = hosts_append_record(out, used,
+					sizeof(reply) - 2, ns_t_aaaa,
+					&entry->addr6[i],
+					sizeof(struct in6_addr));
+	} else if (target && ntohs(q.type) == ns_t_ptr) {
+		unsigned char rdata[NS_MAXDNAME];
+		int rdlen;
+
+		rdlen = hosts_encode_name(target, rdata, sizeof(rdata));
+		if (rdlen > 0) {
+			used = hosts_append_record(out, used,
+					sizeof(reply) - 2, ns_t_ptr,
+					rdata, rdlen);
+			count++;
 		}
 	}
 
-	debug("query %s", name);
+	/* other types of a local name have no data */
+	if (used < 0)
+		return false;
 
-	return 0;
-}
+	hdr = (void *) out;
+	hdr->qr = 1;
+	hdr->aa = 1;
+	hdr->tc = 0;
+	hdr->ra = 1;
+	hdr->rcode = ns_r_noerror;
+	hdr->ancount = htons(count);
+	hdr->nscount = 0;
+	hdr->arcount = 0;
 
-static void client_reset(struct tcp_partial_client_data *client)
-{
-	if (!client)
-		return;
+	debug("local name %s type %d answers %d", name, ntohs(q.type),
+								count);
 
-	if (client->channel) {
-		debug("client %d closing",
-			g_io_channel_unix_get_fd(client->channel));
+	proxy_stats.local_answers++;
 
-		g_io_channel_unref(client->channel);
-		client->channel = NULL;
+	/* too large for the client, let it repeat the query over TCP */
+	if (protocol == IPPROTO_UDP && (unsigned int) used > udp_size) {
+		hdr->tc = 1;
+		hdr->ancount = 0;
+		used = qlen;
 	}
 
-	if (client->watch > 0) {
-		g_source_remove(client->watch);
-		client->watch = 0;
-	}
+	if (protocol == IPPROTO_TCP) {
+		reply[0] = used >> 8;
+		reply[1] = used & 0xff;
 
-	if (client->timeout > 0) {
-		g_source_remove(client->timeout);
-		client->timeout = 0;
+		if (send(sk, reply, used + 2, MSG_NOSIGNAL) < 0)
+			connman_error("Cannot send local answer: %s",
+							strerror(errno));
+		return true;
 	}
 
-	g_free(client->buf);
-	client->buf = NULL;
+	if (udp_batch_queue(sk, out, used, to, tolen))
+		return true;
 
-	client->buf_end = 0;
-}
+	if (sendto(sk, out, used, MSG_NOSIGNAL, to, tolen) < 0)
+		connman_error("Cannot send local answer: %s",
+							strerror(errno));
 
-static unsigned int get_msg_len(unsigned char *buf)
-{
-	return buf[0]<<8 | buf[1];
+	return true;
 }
 
 static bool read_tcp_data(struct tcp_partial_client_data *client,
@@ -3021,12 +5353,13 @@ static bool read_tcp_data(struct tcp_partial_client_data *client,
 {
 	char query[TCP_MAX_BUF_LEN];
 	struct request_data *req;
+	struct client_data *limit;
 	int client_sk, err;
 	unsigned int msg_len;
 	GSList *list;
 	bool waiting_for_connect = false;
-	int qtype = 0;
 	struct cache_entry *entry;
+	struct cache_data *data = NULL;
 
 	client_sk = g_io_channel_unix_get_fd(client->channel);
 
@@ -3066,15 +5399,30 @@ read_another:
 
 	debug("client %d all data %d received", client_sk, msg_len);
 
+	proxy_stats.queries++;
+	proxy_stats.tcp_queries++;
+
 	err = parse_request(client->buf + 2, msg_len,
-			query, sizeof(query));
-	if (err < 0 || (g_slist_length(server_list) == 0)) {
+			query, sizeof(query), NULL);
+	if (err < 0 || !client_admit(client->family, client_addr, &limit)) {
 		send_response(client_sk, client->buf, msg_len + 2,
 			NULL, 0, IPPROTO_TCP);
-		return true;
+		goto out;
+	}
+
+	if (hosts_answer(client_sk, client->buf, msg_len + 2, NULL, 0,
+							IPPROTO_TCP, 0))
+		goto out;
+
+	if (g_slist_length(server_list) == 0) {
+		if (!cache_send_offline(client_sk, client->buf, msg_len + 2,
+						IPPROTO_TCP, NULL, 0, 0))
+			send_response(client_sk, client->buf, msg_len + 2,
+				NULL, 0, IPPROTO_TCP);
+		goto out;
 	}
 
-	req = g_try_new0(struct request_data, 1);
+	req = pool_alloc(&request_pool);
 	if (!req)
 		return true;
 
@@ -3100,37 +5448,71 @@ read_another:
 	 * Check if the answer is found in the cache before
 	 * creating sockets to the server.
 	 */
-	entry = cache_check(client->buf, &qtype, IPPROTO_TCP);
+	entry = cache_check(client->buf, &data, IPPROTO_TCP);
 	if (entry) {
 		int ttl_left = 0;
-		struct cache_data *data;
 
-		debug("cache hit %s type %s", query, qtype == 1 ? "A" : "AAAA");
-		if (qtype == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		debug("cache hit %s type %d", query, data ? data->type : 0);
 
 		if (data) {
 			ttl_left = data->valid_until - time(NULL);
 			entry->hits++;
+			proxy_stats.cache_hits++;
+			cache_prefetch_check(entry, data);
 
-			send_cached_response(client_sk, data->data,
-					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+			send_cached_response(client_sk, data,
+					NULL, 0, IPPROTO_TCP, req->srcid,
+					ttl_left, 0);
 
-			g_free(req);
+			pool_free(&request_pool, req);
 			goto out;
 		} else
 			debug("data missing, ignoring cache for this query");
 	}
 
+	if (client_pending_full(limit)) {
+		proxy_stats.pending_limited++;
+
+		/* the client expects its own id back */
+		client->buf[2] = req->srcid & 0xff;
+		client->buf[3] = req->srcid >> 8;
+
+		send_response(client_sk, client->buf,
+			req->request_len, NULL, 0, IPPROTO_TCP);
+		pool_free(&request_pool, req);
+		goto out;
+	}
+
+	proxy_stats.cache_misses++;
+
 	for (list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
+		struct server_data *tcp_server;
 
 		if (data->protocol != IPPROTO_UDP || !data->enabled)
 			continue;
 
+		/* reuse an open connection to the server if there is one */
+		tcp_server = find_server(data->index, data->server,
+							IPPROTO_TCP);
+		if (tcp_server && tcp_server->connected) {
+			if (ns_resolv(tcp_server, req, client->buf,
+							query) == 0) {
+				tcp_server_touch(tcp_server);
+				waiting_for_connect = true;
+			}
+			continue;
+		}
+
+		/*
+		 * A connection that is still being set up sends the
+		 * queued requests once it is connected.
+		 */
+		if (find_connecting_server(data->index, data->server)) {
+			waiting_for_connect = true;
+			continue;
+		}
+
 		if (!create_server(data->index, NULL, data->server,
 					IPPROTO_TCP))
 			continue;
@@ -3142,7 +5524,7 @@ read_another:
 		/* No server is waiting for connect */
 		send_response(client_sk, client->buf,
 			req->request_len, NULL, 0, IPPROTO_TCP);
-		g_free(req);
+		pool_free(&request_pool, req);
 		return true;
 	}
 
@@ -3152,28 +5534,12 @@ read_another:
 	 * The request will actually be sent once we're
 	 * properly connected over TCP to the nameserver.
 	 */
-	req->request = g_try_malloc0(req->request_len);
-	if (!req->request) {
-		send_response(client_sk, client->buf,
-			req->request_len, NULL, 0, IPPROTO_TCP);
-		g_free(req);
-		goto out;
-	}
-	memcpy(req->request, client->buf, req->request_len);
-
-	req->name = g_try_malloc0(sizeof(query));
-	if (!req->name) {
-		send_response(client_sk, client->buf,
-			req->request_len, NULL, 0, IPPROTO_TCP);
-		g_free(req->request);
-		g_free(req);
-		goto out;
-	}
-	memcpy(req->name, query, sizeof(query));
+	request_set_query(req, client->buf, req->request_len, query);
+	request_set_client(req, limit);
 
-	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
+	request_timer_start(req, 30);
 
-	request_list = g_slist_append(request_list, req);
+	request_add(req);
 
 out:
 	if (client->buf_end > (msg_len + 2)) {
@@ -3451,84 +5817,167 @@ static gboolean tcp6_listener_event(GIOChannel *channel, GIOCondition condition,
 				&ifdata->tcp6_listener_watch);
 }
 
-static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
-				struct listener_data *ifdata, int family,
-				guint *listener_watch)
+static void udp_listener_request(struct listener_data *ifdata, int family,
+				int sk, unsigned char *buf, int len,
+				const void *client_addr,
+				socklen_t client_addr_len)
 {
-	unsigned char buf[768];
 	char query[512];
-	struct request_data *req;
-	struct sockaddr_in6 client_addr6;
-	socklen_t client_addr6_len = sizeof(client_addr6);
-	struct sockaddr_in client_addr4;
-	socklen_t client_addr4_len = sizeof(client_addr4);
-	void *client_addr;
-	socklen_t *client_addr_len;
-	int sk, err, len;
+	struct request_data *req, *leader;
+	struct client_data *client;
+	struct cache_data *data = NULL;
+	guint16 udp_size;
+	GBytes *key;
+	int err;
 
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		*listener_watch = 0;
-		return false;
-	}
+	if (len < 2)
+		return;
 
-	sk = g_io_channel_unix_get_fd(channel);
+	debug("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
 
-	if (family == AF_INET) {
-		client_addr = &client_addr4;
-		client_addr_len = &client_addr4_len;
-	} else {
-		client_addr = &client_addr6;
-		client_addr_len = &client_addr6_len;
-	}
+	proxy_stats.queries++;
 
-	memset(client_addr, 0, *client_addr_len);
-	len = recvfrom(sk, buf, sizeof(buf), 0, client_addr, client_addr_len);
-	if (len < 2)
-		return true;
+	if (!client_admit(family, client_addr, &client))
+		return;
 
-	debug("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
+	err = parse_request(buf, len, query, sizeof(query), &udp_size);
+	if (err == 0 && hosts_answer(sk, buf, len, client_addr,
+				client_addr_len, IPPROTO_UDP, udp_size))
+		return;
 
-	err = parse_request(buf, len, query, sizeof(query));
-	if (err < 0 || (g_slist_length(server_list) == 0)) {
+	if (err < 0) {
 		send_response(sk, buf, len, client_addr,
-				*client_addr_len, IPPROTO_UDP);
-		return true;
+				client_addr_len, IPPROTO_UDP);
+		return;
+	}
+
+	if (g_slist_length(server_list) == 0) {
+		if (!cache_send_offline(sk, buf, len, IPPROTO_UDP,
+					client_addr, client_addr_len, udp_size))
+			send_response(sk, buf, len, client_addr,
+					client_addr_len, IPPROTO_UDP);
+		return;
 	}
 
-	req = g_try_new0(struct request_data, 1);
+	/* a client with too many pending queries only gets cached answers */
+	if (client_pending_full(client) &&
+			(!cache_check(buf, &data, IPPROTO_UDP) || !data)) {
+		proxy_stats.pending_limited++;
+		return;
+	}
+
+	req = pool_alloc(&request_pool);
 	if (!req)
-		return true;
+		return;
 
-	memcpy(&req->sa, client_addr, *client_addr_len);
-	req->sa_len = *client_addr_len;
+	memcpy(&req->sa, client_addr, client_addr_len);
+	req->sa_len = client_addr_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
 	req->family = family;
 
 	req->srcid = buf[0] | (buf[1] << 8);
+	req->udp_size = udp_size;
+	req->request_len = len;
+	req->ifdata = ifdata;
+
+	key = g_bytes_new(buf + 2, len - 2);
+
+	leader = g_hash_table_lookup(inflight_table, key);
+	if (leader) {
+		debug("id 0x%04x waits for id 0x%04x", req->srcid,
+							leader->srcid);
+
+		request_set_query(req, buf, len, query);
+		request_set_client(req, client);
+
+		leader->waiters = g_slist_append(leader->waiters, req);
+		proxy_stats.coalesced_queries++;
+
+		g_bytes_unref(key);
+		return;
+	}
+
 	req->dstid = get_id();
 	req->altid = get_id();
-	req->request_len = len;
 
 	buf[0] = req->dstid & 0xff;
 	buf[1] = req->dstid >> 8;
 
 	req->numserv = 0;
-	req->ifdata = ifdata;
 	req->append_domain = false;
 
 	if (resolv(req, buf, query)) {
 		/* a cached result was sent, so the request can be released */
-	        g_free(req);
-		return true;
+		g_bytes_unref(key);
+		pool_free(&request_pool, req);
+		return;
+	}
+
+	proxy_stats.cache_misses++;
+
+	request_set_query(req, buf, len, query);
+	request_set_client(req, client);
+	request_timer_start(req, req->failover ? FAILOVER_TIMEOUT : 5);
+	request_add(req);
+
+	req->key = key;
+	g_hash_table_replace(inflight_table, g_bytes_ref(key), req);
+}
+
+static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
+				struct listener_data *ifdata, int family,
+				guint *listener_watch)
+{
+	unsigned char buf[UDP_BATCH_SIZE][768];
+	struct sockaddr_in6 client_addr[UDP_BATCH_SIZE];
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	struct udp_batch batch;
+	int sk, i, count;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		*listener_watch = 0;
+		return false;
 	}
 
-	req->name = g_strdup(query);
-	req->request = g_malloc(len);
-	memcpy(req->request, buf, len);
-	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
-	request_list = g_slist_append(request_list, req);
+	sk = g_io_channel_unix_get_fd(channel);
+
+	memset(msgs, 0, sizeof(msgs));
+	memset(client_addr, 0, sizeof(client_addr));
+
+	for (i = 0; i < UDP_BATCH_SIZE; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = sizeof(buf[i]);
+
+		msgs[i].msg_hdr.msg_name = &client_addr[i];
+		msgs[i].msg_hdr.msg_namelen = family == AF_INET ?
+					sizeof(struct sockaddr_in) :
+					sizeof(struct sockaddr_in6);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/*
+	 * Read only what is already queued, at most one batch, so that
+	 * a burst of queries cannot starve the rest of the main loop.
+	 */
+	count = recvmmsg(sk, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (count <= 0)
+		return true;
+
+	batch.sk = sk;
+	batch.count = 0;
+	reply_batch = &batch;
+
+	for (i = 0; i < count; i++)
+		udp_listener_request(ifdata, family, sk, buf[i],
+					msgs[i].msg_len, &client_addr[i],
+					msgs[i].msg_hdr.msg_namelen);
+
+	reply_batch = NULL;
+	udp_batch_flush(&batch);
 
 	return true;
 }
@@ -3787,8 +6236,8 @@ static int create_listener(struct listener_data *ifdata)
 
 static void destroy_listener(struct listener_data *ifdata)
 {
+	struct request_data *req;
 	int index;
-	GSList *list;
 
 	index = connman_inet_ifindex("lo");
 	if (ifdata->index == index) {
@@ -3796,18 +6245,12 @@ static void destroy_listener(struct listener_data *ifdata)
 		__connman_resolvfile_remove(index, NULL, "::1");
 	}
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
-
+	while ((req = g_queue_peek_head(&request_queue))) {
 		debug("Dropping request (id 0x%04x -> 0x%04x)",
 						req->srcid, req->dstid);
 		destroy_request_data(req);
-		list->data = NULL;
 	}
 
-	g_slist_free(request_list);
-	request_list = NULL;
-
 	destroy_tcp_listener(ifdata);
 	destroy_udp_listener(ifdata);
 }
@@ -3890,12 +6333,193 @@ static void free_partial_reqs(gpointer value)
 	g_free(data);
 }
 
+static DBusMessage *get_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+	unsigned int memory;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &array);
+
+	connman_dbus_dict_open(&array, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "Queries",
+				DBUS_TYPE_UINT32, &proxy_stats.queries);
+
+	connman_dbus_dict_append_basic(&dict, "TCPQueries",
+				DBUS_TYPE_UINT32, &proxy_stats.tcp_queries);
+
+	connman_dbus_dict_append_basic(&dict, "CacheHits",
+				DBUS_TYPE_UINT32, &proxy_stats.cache_hits);
+
+	connman_dbus_dict_append_basic(&dict, "CacheMisses",
+				DBUS_TYPE_UINT32, &proxy_stats.cache_misses);
+
+	connman_dbus_dict_append_basic(&dict, "CacheEvictions",
+			DBUS_TYPE_UINT32, &proxy_stats.cache_evictions);
+
+	connman_dbus_dict_append_basic(&dict, "NegativeCacheInserts",
+				DBUS_TYPE_UINT32, &proxy_stats.negative_inserts);
+
+	connman_dbus_dict_append_basic(&dict, "NegativeCacheHits",
+				DBUS_TYPE_UINT32, &proxy_stats.negative_hits);
+
+	connman_dbus_dict_append_basic(&dict, "StaleAnswers",
+				DBUS_TYPE_UINT32, &proxy_stats.stale_hits);
+
+	connman_dbus_dict_append_basic(&dict, "CoalescedQueries",
+			DBUS_TYPE_UINT32, &proxy_stats.coalesced_queries);
+
+	connman_dbus_dict_append_basic(&dict, "UpstreamQueries",
+			DBUS_TYPE_UINT32, &proxy_stats.upstream_queries);
+
+	connman_dbus_dict_append_basic(&dict, "UpstreamTimeouts",
+			DBUS_TYPE_UINT32, &proxy_stats.upstream_timeouts);
+
+	connman_dbus_dict_append_basic(&dict, "TruncatedReplies",
+			DBUS_TYPE_UINT32, &proxy_stats.truncated_replies);
+
+	connman_dbus_dict_append_basic(&dict, "RateLimitedQueries",
+			DBUS_TYPE_UINT32, &proxy_stats.rate_limited);
+
+	connman_dbus_dict_append_basic(&dict, "PendingLimitedQueries",
+			DBUS_TYPE_UINT32, &proxy_stats.pending_limited);
+
+	connman_dbus_dict_append_basic(&dict, "LocalAnswers",
+			DBUS_TYPE_UINT32, &proxy_stats.local_answers);
+
+	connman_dbus_dict_append_basic(&dict, "PendingRequests",
+				DBUS_TYPE_UINT32, &request_pool.used);
+
+	connman_dbus_dict_append_basic(&dict, "CacheMemory",
+				DBUS_TYPE_UINT32, &cache_mem);
+
+	memory = pool_memory(&request_pool) +
+			pool_memory(&cache_entry_pool) +
+			pool_memory(&cache_data_pool);
+	connman_dbus_dict_append_basic(&dict, "PoolMemory",
+				DBUS_TYPE_UINT32, &memory);
+
+	connman_dbus_dict_close(&array, &dict);
+
+	return reply;
+}
+
+static void append_server_struct(gpointer value, gpointer user_data)
+{
+	struct server_data *server = value;
+	DBusMessageIter *iter = user_data;
+	DBusMessageIter entry, dict;
+	dbus_int32_t index = server->index;
+	dbus_uint32_t score = server_score(server);
+
+	if (server->protocol != IPPROTO_UDP)
+		return;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL, &entry);
+
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+							&server->server);
+
+	connman_dbus_dict_open(&entry, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "Index",
+					DBUS_TYPE_INT32, &index);
+
+	connman_dbus_dict_append_basic(&dict, "Enabled",
+					DBUS_TYPE_BOOLEAN, &server->enabled);
+
+	connman_dbus_dict_append_basic(&dict, "RoundTripTime",
+					DBUS_TYPE_UINT32, &server->srtt);
+
+	connman_dbus_dict_append_basic(&dict, "Queries",
+					DBUS_TYPE_UINT32, &server->queries);
+
+	connman_dbus_dict_append_basic(&dict, "Replies",
+					DBUS_TYPE_UINT32, &server->replies);
+
+	connman_dbus_dict_append_basic(&dict, "Score",
+					DBUS_TYPE_UINT32, &score);
+
+	connman_dbus_dict_close(&entry, &dict);
+
+	dbus_message_iter_close_container(iter, &entry);
+}
+
+static DBusMessage *get_servers(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	g_slist_foreach(server_list, append_server_struct, &array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
+static const GDBusMethodTable dnsproxy_methods[] = {
+	{ GDBUS_METHOD("GetStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_statistics) },
+	{ GDBUS_METHOD("GetServers",
+			NULL, GDBUS_ARGS({ "servers", "a(sa{sv})" }),
+			get_servers) },
+	{ },
+};
+
+static DBusConnection *connection = NULL;
+
 int __connman_dnsproxy_init(void)
 {
 	int err, index;
 
 	DBG("");
 
+	cache_max_mem = connman_setting_get_uint("DnsProxyCacheSize") * 1024;
+	negative_max_ttl = connman_setting_get_uint("DnsProxyNegativeCacheTTL");
+	prefetch_threshold =
+		connman_setting_get_uint("DnsProxyPrefetchThreshold");
+	stale_max_time = connman_setting_get_uint("DnsProxyServeStale");
+	race_servers = connman_setting_get_uint("DnsProxyRaceServers");
+	tcp_idle_time = connman_setting_get_uint("DnsProxyTcpIdleTimeout");
+	cache_snapshot_interval =
+		connman_setting_get_uint("DnsProxyCacheSnapshot");
+	client_rate = connman_setting_get_uint("DnsProxyClientRate");
+	client_max_pending =
+		connman_setting_get_uint("DnsProxyClientMaxPending");
+	max_udp_size = connman_setting_get_uint("DnsProxyMaxUdpSize");
+	max_udp_size = MAX(max_udp_size, DNS_UDP_SIZE);
+	max_udp_size = MIN(max_udp_size, DNS_MAX_UDP_SIZE);
+	udp_reply_buf = g_malloc(max_udp_size);
+	udp_batch_buf = g_malloc(UDP_BATCH_SIZE * max_udp_size);
+
 	listener_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, g_free);
 
@@ -3904,6 +6528,19 @@ int __connman_dnsproxy_init(void)
 							NULL,
 							free_partial_reqs);
 
+	request_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	inflight_table = g_hash_table_new_full(g_bytes_hash, g_bytes_equal,
+					(GDestroyNotify) g_bytes_unref, NULL);
+	client_table = g_hash_table_new_full(client_hash, client_equal,
+							g_free, NULL);
+
+	hosts_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, host_entry_free);
+	hosts_reverse = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, g_free);
+	hosts_load();
+	connman_inotify_register(CONFIGDIR, hosts_notify);
+
 	index = connman_inet_ifindex("lo");
 	err = __connman_dnsproxy_add_listener(index);
 	if (err < 0)
@@ -3913,12 +6550,42 @@ int __connman_dnsproxy_init(void)
 	if (err < 0)
 		goto destroy;
 
+	if (cache_snapshot_interval > 0)
+		cache_snapshot_timer = g_timeout_add_seconds(
+					cache_snapshot_interval,
+					cache_snapshot_timeout, NULL);
+
+	connection = connman_dbus_get_connection();
+	if (connection)
+		g_dbus_register_interface(connection, CONNMAN_MANAGER_PATH,
+						CONNMAN_DNSPROXY_INTERFACE,
+						dnsproxy_methods, NULL,
+						NULL, NULL, NULL);
+
 	return 0;
 
 destroy:
 	__connman_dnsproxy_remove_listener(index);
 	g_hash_table_destroy(listener_table);
 	g_hash_table_destroy(partial_tcp_req_table);
+	g_hash_table_destroy(request_table);
+	request_table = NULL;
+	g_hash_table_destroy(inflight_table);
+	inflight_table = NULL;
+	g_hash_table_destroy(client_table);
+	client_table = NULL;
+	g_queue_clear(&client_lru);
+
+	connman_inotify_unregister(CONFIGDIR, hosts_notify);
+	g_hash_table_destroy(hosts_table);
+	hosts_table = NULL;
+	g_hash_table_destroy(hosts_reverse);
+	hosts_reverse = NULL;
+
+	g_free(udp_reply_buf);
+	udp_reply_buf = NULL;
+	g_free(udp_batch_buf);
+	udp_batch_buf = NULL;
 
 	return err;
 }
@@ -3932,11 +6599,25 @@ void __connman_dnsproxy_cleanup(void)
 		cache_timer = 0;
 	}
 
+	if (cache_snapshot_timer) {
+		g_source_remove(cache_snapshot_timer);
+		cache_snapshot_timer = 0;
+	}
+
+	cache_snapshot_save();
+
 	if (cache) {
 		g_hash_table_destroy(cache);
 		cache = NULL;
 	}
 
+	if (connection) {
+		g_dbus_unregister_interface(connection, CONNMAN_MANAGER_PATH,
+						CONNMAN_DNSPROXY_INTERFACE);
+		dbus_connection_unref(connection);
+		connection = NULL;
+	}
+
 	connman_notifier_unregister(&dnsproxy_notifier);
 
 	g_hash_table_foreach(listener_table, remove_listener, NULL);
@@ -3944,4 +6625,32 @@ void __connman_dnsproxy_cleanup(void)
 	g_hash_table_destroy(listener_table);
 
 	g_hash_table_destroy(partial_tcp_req_table);
+
+	if (request_wheel_timer) {
+		g_source_remove(request_wheel_timer);
+		request_wheel_timer = 0;
+	}
+
+	g_hash_table_destroy(request_table);
+	request_table = NULL;
+	g_hash_table_destroy(inflight_table);
+	inflight_table = NULL;
+	g_hash_table_destroy(client_table);
+	client_table = NULL;
+	g_queue_clear(&client_lru);
+
+	connman_inotify_unregister(CONFIGDIR, hosts_notify);
+	g_hash_table_destroy(hosts_table);
+	hosts_table = NULL;
+	g_hash_table_destroy(hosts_reverse);
+	hosts_reverse = NULL;
+
+	pool_destroy(&request_pool);
+	pool_destroy(&cache_entry_pool);
+	pool_destroy(&cache_data_pool);
+
+	g_free(udp_reply_buf);
+	udp_reply_buf = NULL;
+	g_free(udp_batch_buf);
+	udp_batch_buf = NULL;
 }
@@ -41,6 +41,16 @@
 
 #define DEFAULT_INPUT_REQUEST_TIMEOUT (120 * 1000)
 #define DEFAULT_BROWSER_LAUNCH_TIMEOUT (300 * 1000)
+#define DEFAULT_DNSPROXY_CACHE_SIZE 64
+#define DEFAULT_DNSPROXY_NEGATIVE_TTL 300
+#define DEFAULT_DNSPROXY_PREFETCH_THRESHOLD 3
+#define DEFAULT_DNSPROXY_SERVE_STALE 0
+#define DEFAULT_DNSPROXY_RACE_SERVERS 2
+#define DEFAULT_DNSPROXY_TCP_IDLE_TIMEOUT 10
+#define DEFAULT_DNSPROXY_CACHE_SNAPSHOT 0
+#define DEFAULT_DNSPROXY_MAX_UDP_SIZE 4096
+#define DEFAULT_DNSPROXY_CLIENT_RATE 100
+#define DEFAULT_DNSPROXY_CLIENT_MAX_PENDING 64
 
 #define MAINFILE "main.conf"
 #define CONFIGMAINFILE CONFIGDIR "/" MAINFILE
@@ -79,6 +89,16 @@ static struct {
 	bool enable_6to4;
 	char *vendor_class_id;
 	bool enable_online_check;
+	unsigned int dnsproxy_cache_size;
+	unsigned int dnsproxy_negative_ttl;
+	unsigned int dnsproxy_prefetch_threshold;
+	unsigned int dnsproxy_serve_stale;
+	unsigned int dnsproxy_race_servers;
+	unsigned int dnsproxy_tcp_idle_timeout;
+	unsigned int dnsproxy_cache_snapshot;
+	unsigned int dnsproxy_max_udp_size;
+	unsigned int dnsproxy_client_rate;
+	unsigned int dnsproxy_client_max_pending;
 } connman_settings  = {
 	.bg_scan = true,
 	.pref_timeservers = NULL,
@@ -96,6 +116,16 @@ static struct {
 	.enable_6to4 = false,
 	.vendor_class_id = NULL,
 	.enable_online_check = true,
+	.dnsproxy_cache_size = DEFAULT_DNSPROXY_CACHE_SIZE,
+	.dnsproxy_negative_ttl = DEFAULT_DNSPROXY_NEGATIVE_TTL,
+	.dnsproxy_prefetch_threshold = DEFAULT_DNSPROXY_PREFETCH_THRESHOLD,
+	.dnsproxy_serve_stale = DEFAULT_DNSPROXY_SERVE_STALE,
+	.dnsproxy_race_servers = DEFAULT_DNSPROXY_RACE_SERVERS,
+	.dnsproxy_tcp_idle_timeout = DEFAULT_DNSPROXY_TCP_IDLE_TIMEOUT,
+	.dnsproxy_cache_snapshot = DEFAULT_DNSPROXY_CACHE_SNAPSHOT,
+	.dnsproxy_max_udp_size = DEFAULT_DNSPROXY_MAX_UDP_SIZE,
+	.dnsproxy_client_rate = DEFAULT_DNSPROXY_CLIENT_RATE,
+	.dnsproxy_client_max_pending = DEFAULT_DNSPROXY_CLIENT_MAX_PENDING,
 };
 
 #define CONF_BG_SCAN                    "BackgroundScanning"
@@ -114,6 +144,16 @@ static struct {
 #define CONF_ENABLE_6TO4                "Enable6to4"
 #define CONF_VENDOR_CLASS_ID            "VendorClassID"
 #define CONF_ENABLE_ONLINE_CHECK        "EnableOnlineCheck"
+#define CONF_DNSPROXY_CACHE_SIZE        "DnsProxyCacheSize"
+#define CONF_DNSPROXY_NEGATIVE_TTL      "DnsProxyNegativeCacheTTL"
+#define CONF_DNSPROXY_PREFETCH_THRESHOLD "DnsProxyPrefetchThreshold"
+#define CONF_DNSPROXY_SERVE_STALE       "DnsProxyServeStale"
+#define CONF_DNSPROXY_RACE_SERVERS      "DnsProxyRaceServers"
+#define CONF_DNSPROXY_TCP_IDLE_TIMEOUT  "DnsProxyTcpIdleTimeout"
+#define CONF_DNSPROXY_CACHE_SNAPSHOT    "DnsProxyCacheSnapshot"
+#define CONF_DNSPROXY_MAX_UDP_SIZE      "DnsProxyMaxUdpSize"
+#define CONF_DNSPROXY_CLIENT_RATE       "DnsProxyClientRate"
+#define CONF_DNSPROXY_CLIENT_MAX_PENDING "DnsProxyClientMaxPending"
 
 static const char *supported_options[] = {
 	CONF_BG_SCAN,
@@ -132,6 +172,16 @@ static const char *supported_options[] = {
 	CONF_ENABLE_6TO4,
 	CONF_VENDOR_CLASS_ID,
 	CONF_ENABLE_ONLINE_CHECK,
+	CONF_DNSPROXY_CACHE_SIZE,
+	CONF_DNSPROXY_NEGATIVE_TTL,
+	CONF_DNSPROXY_PREFETCH_THRESHOLD,
+	CONF_DNSPROXY_SERVE_STALE,
+	CONF_DNSPROXY_RACE_SERVERS,
+	CONF_DNSPROXY_TCP_IDLE_TIMEOUT,
+	CONF_DNSPROXY_CACHE_SNAPSHOT,
+	CONF_DNSPROXY_MAX_UDP_SIZE,
+	CONF_DNSPROXY_CLIENT_RATE,
+	CONF_DNSPROXY_CLIENT_MAX_PENDING,
 	NULL
 };
 
@@ -257,6 +307,7 @@ static void parse_config(GKeyFile *config)
         char *vendor_class_id;
 	gsize len;
 	int timeout;
+	int size;
 
 	if (!config) {
 		connman_settings.auto_connect =
@@ -408,6 +459,76 @@ static void parse_config(GKeyFile *config)
 	}
 
 	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_CACHE_SIZE, &error);
+	if (!error && size >= 0)
+		connman_settings.dnsproxy_cache_size = size;
+
+	g_clear_error(&error);
+
+	timeout = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_NEGATIVE_TTL, &error);
+	if (!error && timeout >= 0)
+		connman_settings.dnsproxy_negative_ttl = timeout;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_PREFETCH_THRESHOLD, &error);
+	if (!error && size >= 0)
+		connman_settings.dnsproxy_prefetch_threshold = size;
+
+	g_clear_error(&error);
+
+	timeout = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_SERVE_STALE, &error);
+	if (!error && timeout >= 0)
+		connman_settings.dnsproxy_serve_stale = timeout;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_RACE_SERVERS, &error);
+	if (!error && size >= 0)
+		connman_settings.dnsproxy_race_servers = size;
+
+	g_clear_error(&error);
+
+	timeout = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_TCP_IDLE_TIMEOUT, &error);
+	if (!error && timeout >= 0)
+		connman_settings.dnsproxy_tcp_idle_timeout = timeout;
+
+	g_clear_error(&error);
+
+	timeout = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_CACHE_SNAPSHOT, &error);
+	if (!error && timeout >= 0)
+		connman_settings.dnsproxy_cache_snapshot = timeout;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_MAX_UDP_SIZE, &error);
+	if (!error && size >= 0)
+		connman_settings.dnsproxy_max_udp_size = size;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_CLIENT_RATE, &error);
+	if (!error && size >= 0)
+		connman_settings.dnsproxy_client_rate = size;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_CLIENT_MAX_PENDING, &error);
+	if (!error && size >= 0)
+		connman_settings.dnsproxy_client_max_pending = size;
+
+	g_clear_error(&error);
 }
 
 static int config_init(const char *file)
@@ -640,6 +761,41 @@ unsigned int *connman_setting_get_uint_list(const char *key)
 	return NULL;
 }
 
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, CONF_DNSPROXY_CACHE_SIZE))
+		return connman_settings.dnsproxy_cache_size;
+
+	if (g_str_equal(key, CONF_DNSPROXY_NEGATIVE_TTL))
+		return connman_settings.dnsproxy_negative_ttl;
+
+	if (g_str_equal(key, CONF_DNSPROXY_PREFETCH_THRESHOLD))
+		return connman_settings.dnsproxy_prefetch_threshold;
+
+	if (g_str_equal(key, CONF_DNSPROXY_SERVE_STALE))
+		return connman_settings.dnsproxy_serve_stale;
+
+	if (g_str_equal(key, CONF_DNSPROXY_RACE_SERVERS))
+		return connman_settings.dnsproxy_race_servers;
+
+	if (g_str_equal(key, CONF_DNSPROXY_TCP_IDLE_TIMEOUT))
+		return connman_settings.dnsproxy_tcp_idle_timeout;
+
+	if (g_str_equal(key, CONF_DNSPROXY_CACHE_SNAPSHOT))
+		return connman_settings.dnsproxy_cache_snapshot;
+
+	if (g_str_equal(key, CONF_DNSPROXY_MAX_UDP_SIZE))
+		return connman_settings.dnsproxy_max_udp_size;
+
+	if (g_str_equal(key, CONF_DNSPROXY_CLIENT_RATE))
+		return connman_settings.dnsproxy_client_rate;
+
+	if (g_str_equal(key, CONF_DNSPROXY_CLIENT_MAX_PENDING))
+		return connman_settings.dnsproxy_client_max_pending;
+
+	return 0;
+}
+
 unsigned int connman_timeout_input_request(void)
 {
 	return connman_settings.timeout_inputreq;
@@ -722,6 +878,7 @@ int main(int argc, char *argv[])
 
 	__connman_util_init();
 	__connman_inotify_init();
+	__connman_storage_init();
 	__connman_technology_init();
 	__connman_notifier_init();
 	__connman_agent_init();
@@ -803,6 +960,7 @@ int main(int argc, char *argv[])
 	__connman_network_cleanup();
 	__connman_dhcp_cleanup();
 	__connman_service_cleanup();
+	__connman_storage_cleanup();
 	__connman_agent_cleanup();
 	__connman_ipconfig_cleanup();
 	__connman_notifier_cleanup();
@@ -59,9 +59,13 @@ struct watch_data {
 static GSList *watch_list = NULL;
 static unsigned int watch_id = 0;
 
-static GSList *update_list = NULL;
-static guint update_interval = G_MAXUINT;
-static guint update_timeout = 0;
+struct update_data {
+	unsigned int interval;
+	unsigned int refcount;
+	guint timeout;
+};
+
+static GHashTable *update_table = NULL;
 
 struct interface_data {
 	int index;
@@ -362,12 +366,36 @@ static const char *operstate2str(unsigned char operstate)
 	return "";
 }
 
+static void extract_stats32(struct rtattr *attr,
+				struct rtnl_link_stats64 *stats)
+{
+	struct rtnl_link_stats stats32;
+
+	memset(&stats32, 0, sizeof(stats32));
+	memcpy(&stats32, RTA_DATA(attr),
+		MIN(RTA_PAYLOAD(attr), sizeof(stats32)));
+
+	stats->rx_packets = stats32.rx_packets;
+	stats->tx_packets = stats32.tx_packets;
+	stats->rx_bytes = stats32.rx_bytes;
+	stats->tx_bytes = stats32.tx_bytes;
+	stats->rx_errors = stats32.rx_errors;
+	stats->tx_errors = stats32.tx_errors;
+	stats->rx_dropped = stats32.rx_dropped;
+	stats->tx_dropped = stats32.tx_dropped;
+}
+
+/*
+ * @stats32 tells whether the statistics came from IFLA_STATS, whose
+ * 32-bit counters wrap around.
+ */
 static bool extract_link(struct ifinfomsg *msg, int bytes,
 				struct ether_addr *address, const char **ifname,
 				unsigned int *mtu, unsigned char *operstate,
-				struct rtnl_link_stats *stats)
+				struct rtnl_link_stats64 *stats, bool *stats32)
 {
 	struct rtattr *attr;
+	bool stats64 = false;
 
 	for (attr = IFLA_RTA(msg); RTA_OK(attr, bytes);
 					attr = RTA_NEXT(attr, bytes)) {
@@ -385,9 +413,20 @@ static bool extract_link(struct ifinfomsg *msg, int bytes,
 				*mtu = *((unsigned int *) RTA_DATA(attr));
 			break;
 		case IFLA_STATS:
-			if (stats)
+			/* Only used by kernels without IFLA_STATS64 */
+			if (stats && !stats64) {
+				extract_stats32(attr, stats);
+				*stats32 = true;
+			}
+			break;
+		case IFLA_STATS64:
+			if (stats) {
+				memset(stats, 0, sizeof(*stats));
 				memcpy(stats, RTA_DATA(attr),
-					sizeof(struct rtnl_link_stats));
+					MIN(RTA_PAYLOAD(attr), sizeof(*stats)));
+				stats64 = true;
+				*stats32 = false;
+			}
 			break;
 		case IFLA_OPERSTATE:
 			if (operstate)
@@ -407,16 +446,18 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 			unsigned change, struct ifinfomsg *msg, int bytes)
 {
 	struct ether_addr address = {{ 0, 0, 0, 0, 0, 0 }};
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
 	unsigned char operstate = 0xff;
 	struct interface_data *interface;
 	const char *ifname = NULL;
 	unsigned int mtu = 0;
+	bool stats32 = false;
 	char ident[13], str[18];
 	GSList *list;
 
 	memset(&stats, 0, sizeof(stats));
-	if (!extract_link(msg, bytes, &address, &ifname, &mtu, &operstate, &stats))
+	if (!extract_link(msg, bytes, &address, &ifname, &mtu, &operstate,
+							&stats, &stats32))
 		return;
 
 	snprintf(ident, 13, "%02x%02x%02x%02x%02x%02x",
@@ -448,7 +489,7 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 	case ARPHRD_PPP:
 	case ARPHRD_NONE:
 		__connman_ipconfig_newlink(index, type, flags,
-							str, mtu, &stats);
+						str, mtu, &stats, stats32);
 		break;
 	}
 
@@ -507,13 +548,15 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 static void process_dellink(unsigned short type, int index, unsigned flags,
 			unsigned change, struct ifinfomsg *msg, int bytes)
 {
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
 	unsigned char operstate = 0xff;
 	const char *ifname = NULL;
+	bool stats32 = false;
 	GSList *list;
 
 	memset(&stats, 0, sizeof(stats));
-	if (!extract_link(msg, bytes, NULL, &ifname, NULL, &operstate, &stats))
+	if (!extract_link(msg, bytes, NULL, &ifname, NULL, &operstate,
+							&stats, &stats32))
 		return;
 
 	if (operstate != 0xff)
@@ -534,7 +577,7 @@ static void process_dellink(unsigned short type, int index, unsigned flags,
 	case ARPHDR_PHONET_PIPE:
 	case ARPHRD_PPP:
 	case ARPHRD_NONE:
-		__connman_ipconfig_dellink(index, &stats);
+		__connman_ipconfig_dellink(index, &stats, stats32);
 		break;
 	}
 
@@ -916,6 +959,9 @@ static void rtnl_link(struct nlmsghdr *hdr)
 		case IFLA_STATS:
 			print_attr(attr, "stats");
 			break;
+		case IFLA_STATS64:
+			print_attr(attr, "stats64");
+			break;
 		case IFLA_COST:
 			print_attr(attr, "cost");
 			break;
@@ -1305,9 +1351,14 @@ static guint channel_watch = 0;
 
 struct rtnl_request {
 	struct nlmsghdr hdr;
-	struct rtgenmsg msg;
+	union {
+		struct rtgenmsg gen;
+		struct ifinfomsg link;
+	} msg;
 };
 #define RTNL_REQUEST_SIZE  (sizeof(struct nlmsghdr) + sizeof(struct rtgenmsg))
+#define RTNL_LINK_REQUEST_SIZE  (sizeof(struct nlmsghdr) + \
+					sizeof(struct ifinfomsg))
 
 static GSList *request_list = NULL;
 static guint32 request_seq = 0;
@@ -1374,6 +1425,21 @@ static int process_response(guint32 seq)
 	return send_request(req);
 }
 
+/*
+ * Replies to a request for a single object are neither multipart nor
+ * terminated by NLMSG_DONE, so the reply itself completes the request.
+ */
+static void process_single_response(struct nlmsghdr *hdr)
+{
+	if (hdr->nlmsg_flags & NLM_F_MULTI || hdr->nlmsg_pid == 0)
+		return;
+
+	if (!find_request(hdr->nlmsg_seq))
+		return;
+
+	process_response(hdr->nlmsg_seq);
+}
+
 static void rtnl_message(void *buf, size_t len)
 {
 	while (len > 0) {
@@ -1400,9 +1466,11 @@ static void rtnl_message(void *buf, size_t len)
 			err = NLMSG_DATA(hdr);
 			DBG("error %d (%s)", -err->error,
 						strerror(-err->error));
+			process_single_response(hdr);
 			return;
 		case RTM_NEWLINK:
 			rtnl_newlink(hdr);
+			process_single_response(hdr);
 			break;
 		case RTM_DELLINK:
 			rtnl_dellink(hdr);
@@ -1473,7 +1541,7 @@ static int send_getlink(void)
 
 	DBG("");
 
-	req = g_try_malloc0(RTNL_REQUEST_SIZE);
+	req = g_try_malloc0(sizeof(*req));
 	if (!req)
 		return -ENOMEM;
 
@@ -1482,7 +1550,49 @@ static int send_getlink(void)
 	req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
 	req->hdr.nlmsg_pid = 0;
 	req->hdr.nlmsg_seq = request_seq++;
-	req->msg.rtgen_family = AF_INET;
+	req->msg.gen.rtgen_family = AF_INET;
+
+	return queue_request(req);
+}
+
+static bool getlink_pending(int index)
+{
+	GSList *list;
+
+	for (list = request_list; list; list = list->next) {
+		struct rtnl_request *req = list->data;
+
+		if (req->hdr.nlmsg_type != RTM_GETLINK)
+			continue;
+
+		if (req->hdr.nlmsg_flags & NLM_F_DUMP ||
+				req->msg.link.ifi_index == index)
+			return true;
+	}
+
+	return false;
+}
+
+static int send_getlink_index(int index)
+{
+	struct rtnl_request *req;
+
+	DBG("index %d", index);
+
+	if (getlink_pending(index))
+		return 0;
+
+	req = g_try_malloc0(sizeof(*req));
+	if (!req)
+		return -ENOMEM;
+
+	req->hdr.nlmsg_len = RTNL_LINK_REQUEST_SIZE;
+	req->hdr.nlmsg_type = RTM_GETLINK;
+	req->hdr.nlmsg_flags = NLM_F_REQUEST;
+	req->hdr.nlmsg_pid = 0;
+	req->hdr.nlmsg_seq = request_seq++;
+	req->msg.link.ifi_family = AF_UNSPEC;
+	req->msg.link.ifi_index = index;
 
 	return queue_request(req);
 }
@@ -1493,7 +1603,7 @@ static int send_getaddr(void)
 
 	DBG("");
 
-	req = g_try_malloc0(RTNL_REQUEST_SIZE);
+	req = g_try_malloc0(sizeof(*req));
 	if (!req)
 		return -ENOMEM;
 
@@ -1502,7 +1612,7 @@ static int send_getaddr(void)
 	req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
 	req->hdr.nlmsg_pid = 0;
 	req->hdr.nlmsg_seq = request_seq++;
-	req->msg.rtgen_family = AF_INET;
+	req->msg.gen.rtgen_family = AF_INET;
 
 	return queue_request(req);
 }
@@ -1513,7 +1623,7 @@ static int send_getroute(void)
 
 	DBG("");
 
-	req = g_try_malloc0(RTNL_REQUEST_SIZE);
+	req = g_try_malloc0(sizeof(*req));
 	if (!req)
 		return -ENOMEM;
 
@@ -1522,81 +1632,107 @@ static int send_getroute(void)
 	req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
 	req->hdr.nlmsg_pid = 0;
 	req->hdr.nlmsg_seq = request_seq++;
-	req->msg.rtgen_family = AF_INET;
+	req->msg.gen.rtgen_family = AF_INET;
 
 	return queue_request(req);
 }
 
-static gboolean update_timeout_cb(gpointer user_data)
+/*
+ * Poll the interfaces of the services with counters at @interval, or
+ * with any counter if @interval is 0.
+ */
+static int request_update(unsigned int interval)
 {
-	__connman_rtnl_request_update();
+	GSList *indexes, *list;
+	int err = 0;
 
-	return TRUE;
+	indexes = __connman_service_get_counted_indexes(interval);
+
+	for (list = indexes; list; list = list->next) {
+		err = send_getlink_index(GPOINTER_TO_INT(list->data));
+		if (err < 0)
+			break;
+	}
+
+	g_slist_free(indexes);
+
+	return err;
 }
 
-static void update_interval_callback(guint min)
+static gboolean update_timeout_cb(gpointer user_data)
 {
-	if (update_timeout > 0)
-		g_source_remove(update_timeout);
+	struct update_data *update = user_data;
 
-	if (min < G_MAXUINT) {
-		update_interval = min;
-		update_timeout = g_timeout_add_seconds(update_interval,
-						update_timeout_cb, NULL);
-	} else {
-		update_timeout = 0;
-		update_interval = G_MAXUINT;
-	}
+	request_update(update->interval);
+
+	return TRUE;
 }
 
-static gint compare_interval(gconstpointer a, gconstpointer b)
+static void free_update(gpointer data)
 {
-	guint val_a = GPOINTER_TO_UINT(a);
-	guint val_b = GPOINTER_TO_UINT(b);
+	struct update_data *update = data;
+
+	if (update->timeout > 0)
+		g_source_remove(update->timeout);
 
-	return val_a - val_b;
+	g_free(update);
 }
 
+/*
+ * Every interval that counters are registered with has its own timer,
+ * which only polls the interfaces those counters need.
+ */
 unsigned int __connman_rtnl_update_interval_add(unsigned int interval)
 {
-	guint min;
+	struct update_data *update;
 
-	if (interval == 0)
+	if (interval == 0 || !update_table)
 		return 0;
 
-	update_list = g_slist_insert_sorted(update_list,
-			GUINT_TO_POINTER(interval), compare_interval);
-
-	min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
-	if (min < update_interval) {
-		update_interval_callback(min);
-		__connman_rtnl_request_update();
+	update = g_hash_table_lookup(update_table,
+					GUINT_TO_POINTER(interval));
+	if (update) {
+		update->refcount++;
+		return interval;
 	}
 
-	return update_interval;
+	update = g_new0(struct update_data, 1);
+	update->interval = interval;
+	update->refcount = 1;
+	update->timeout = g_timeout_add_seconds(interval,
+						update_timeout_cb, update);
+
+	g_hash_table_replace(update_table, GUINT_TO_POINTER(interval),
+								update);
+
+	request_update(interval);
+
+	return interval;
 }
 
 unsigned int __connman_rtnl_update_interval_remove(unsigned int interval)
 {
-	guint min = G_MAXUINT;
+	struct update_data *update;
 
-	if (interval == 0)
+	if (interval == 0 || !update_table)
 		return 0;
 
-	update_list = g_slist_remove(update_list, GINT_TO_POINTER(interval));
+	update = g_hash_table_lookup(update_table,
+					GUINT_TO_POINTER(interval));
+	if (!update)
+		return 0;
 
-	if (update_list)
-		min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
+	if (--update->refcount > 0)
+		return update->refcount;
 
-	if (min > update_interval)
-		update_interval_callback(min);
+	g_hash_table_remove(update_table, GUINT_TO_POINTER(interval));
 
-	return min;
+	return 0;
 }
 
 int __connman_rtnl_request_update(void)
 {
-	return send_getlink();
+	return request_update(0);
 }
 
 int __connman_rtnl_init(void)
@@ -1609,6 +1745,9 @@ int __connman_rtnl_init(void)
 	interface_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, free_interface);
 
+	update_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, free_update);
+
 	sk = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
 	if (sk < 0)
 		return -1;
@@ -1664,8 +1803,8 @@ void __connman_rtnl_cleanup(void)
 	g_slist_free(watch_list);
 	watch_list = NULL;
 
-	g_slist_free(update_list);
-	update_list = NULL;
+	g_hash_table_destroy(update_table);
+	update_table = NULL;
 
 	for (list = request_list; list; list = list->next) {
 		struct rtnl_request *req = list->data;
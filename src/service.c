@@ -38,14 +38,24 @@
 #include "connman.h"
 
 #define CONNECT_TIMEOUT		120
+#define SAVE_DELAY		2
+
+/* save_table values, whether the settings existed when queued */
+#define SAVE_NEW		GINT_TO_POINTER(1)
+#define SAVE_STORED		GINT_TO_POINTER(2)
 
 static DBusConnection *connection = NULL;
 
 static GList *service_list = NULL;
 static GHashTable *service_hash = NULL;
+static GHashTable *path_hash = NULL;
+static GHashTable *index_hash = NULL;
+static unsigned int type_rank[CONNMAN_SERVICE_TYPE_P2P + 1];
 static GSList *counter_list = NULL;
 static unsigned int autoconnect_timeout = 0;
 static unsigned int vpn_autoconnect_timeout = 0;
+static GHashTable *save_table = NULL;
+static unsigned int save_timeout = 0;
 static struct connman_service *current_default = NULL;
 static bool services_dirty = false;
 
@@ -139,33 +149,32 @@ static struct connman_ipconfig *create_ip4config(struct connman_service *service
 static struct connman_ipconfig *create_ip6config(struct connman_service *service,
 		int index);
 static void dns_changed(struct connman_service *service);
+static void service_list_reposition(struct connman_service *service);
 
-struct find_data {
-	const char *path;
-	struct connman_service *service;
-};
-
-static void compare_path(gpointer value, gpointer user_data)
+static struct connman_service *find_service(const char *path)
 {
-	struct connman_service *service = value;
-	struct find_data *data = user_data;
+	DBG("path %s", path);
 
-	if (data->service)
-		return;
+	if (!path)
+		return NULL;
 
-	if (g_strcmp0(service->path, data->path) == 0)
-		data->service = service;
+	return g_hash_table_lookup(path_hash, path);
 }
 
-static struct connman_service *find_service(const char *path)
+/*
+ * The index lookup returns the first service in service_list using
+ * the interface, so its cached results are dropped whenever the
+ * order of the list or the index of an ipconfig changes.
+ */
+static void index_hash_reset(void)
 {
-	struct find_data data = { .path = path, .service = NULL };
-
-	DBG("path %s", path);
-
-	g_list_foreach(service_list, compare_path, &data);
+	if (index_hash)
+		g_hash_table_remove_all(index_hash);
+}
 
-	return data.service;
+void __connman_service_index_changed(void)
+{
+	index_hash_reset();
 }
 
 static const char *reason2string(enum connman_service_connect_reason reason)
@@ -355,6 +364,16 @@ static enum connman_service_proxy_method string2proxymethod(const char *method)
 		return CONNMAN_SERVICE_PROXY_METHOD_UNKNOWN;
 }
 
+/* The order is a sort key, the service moves with it */
+static void set_order(struct connman_service *service, unsigned int order)
+{
+	if (service->order == order)
+		return;
+
+	service->order = order;
+	service_list_reposition(service);
+}
+
 static void set_split_routing(struct connman_service *service, bool value)
 {
 	if (service->type != CONNMAN_SERVICE_TYPE_VPN)
@@ -363,9 +382,9 @@ static void set_split_routing(struct connman_service *service, bool value)
 	service->do_split_routing = value;
 
 	if (service->do_split_routing)
-		service->order = 0;
+		set_order(service, 0);
 	else
-		service->order = 10;
+		set_order(service, 10);
 }
 
 int __connman_service_load_modifiable(struct connman_service *service)
@@ -603,7 +622,7 @@ done:
 	return err;
 }
 
-static int service_save(struct connman_service *service)
+static int service_write(struct connman_service *service)
 {
 	GKeyFile *keyfile;
 	gchar *str;
@@ -795,12 +814,94 @@ done:
 	return err;
 }
 
+/*
+ * Settings that were removed while their write was pending stay
+ * removed, the write must not create them again.
+ */
+static void service_write_pending(struct connman_service *service,
+							gpointer saved)
+{
+	if (saved == SAVE_STORED &&
+			!__connman_storage_service_exists(service->identifier)) {
+		DBG("service %p settings removed", service);
+		return;
+	}
+
+	service_write(service);
+}
+
+static gboolean save_timeout_cb(gpointer user_data)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	DBG("");
+
+	save_timeout = 0;
+
+	g_hash_table_iter_init(&iter, save_table);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		service_write_pending(key, value);
+		g_hash_table_iter_remove(&iter);
+	}
+
+	return FALSE;
+}
+
+/*
+ * Settings are written with a delay so that the many saves done
+ * while a service changes state collapse into one write.
+ */
+static int service_save(struct connman_service *service)
+{
+	if (service->new_service)
+		return -ESRCH;
+
+	if (!g_hash_table_lookup(save_table, service))
+		g_hash_table_insert(save_table, service,
+			__connman_storage_service_exists(service->identifier) ?
+						SAVE_STORED : SAVE_NEW);
+
+	if (!save_timeout)
+		save_timeout = g_timeout_add_seconds(SAVE_DELAY,
+						save_timeout_cb, NULL);
+
+	return 0;
+}
+
+static int service_save_now(struct connman_service *service)
+{
+	g_hash_table_remove(save_table, service);
+
+	return service_write(service);
+}
+
+static void service_save_flush(struct connman_service *service)
+{
+	gpointer saved = g_hash_table_lookup(save_table, service);
+
+	if (!saved)
+		return;
+
+	g_hash_table_remove(save_table, service);
+	service_write_pending(service, saved);
+}
+
 void __connman_service_save(struct connman_service *service)
 {
 	if (!service)
 		return;
 
-	service_save(service);
+	service_save_now(service);
+}
+
+/* The settings of the service are about to be removed */
+void __connman_service_save_cancel(struct connman_service *service)
+{
+	if (!service || !save_table)
+		return;
+
+	g_hash_table_remove(save_table, service);
 }
 
 static enum connman_service_state combine_state(
@@ -2096,49 +2197,49 @@ static void stats_append_counters(DBusMessageIter *dict,
 	if (counters->rx_packets != stats->rx_packets || append_all) {
 		counters->rx_packets = stats->rx_packets;
 		connman_dbus_dict_append_basic(dict, "RX.Packets",
-					DBUS_TYPE_UINT32, &stats->rx_packets);
+					DBUS_TYPE_UINT64, &stats->rx_packets);
 	}
 
 	if (counters->tx_packets != stats->tx_packets || append_all) {
 		counters->tx_packets = stats->tx_packets;
 		connman_dbus_dict_append_basic(dict, "TX.Packets",
-					DBUS_TYPE_UINT32, &stats->tx_packets);
+					DBUS_TYPE_UINT64, &stats->tx_packets);
 	}
 
 	if (counters->rx_bytes != stats->rx_bytes || append_all) {
 		counters->rx_bytes = stats->rx_bytes;
 		connman_dbus_dict_append_basic(dict, "RX.Bytes",
-					DBUS_TYPE_UINT32, &stats->rx_bytes);
+					DBUS_TYPE_UINT64, &stats->rx_bytes);
 	}
 
 	if (counters->tx_bytes != stats->tx_bytes || append_all) {
 		counters->tx_bytes = stats->tx_bytes;
 		connman_dbus_dict_append_basic(dict, "TX.Bytes",
-					DBUS_TYPE_UINT32, &stats->tx_bytes);
+					DBUS_TYPE_UINT64, &stats->tx_bytes);
 	}
 
 	if (counters->rx_errors != stats->rx_errors || append_all) {
 		counters->rx_errors = stats->rx_errors;
 		connman_dbus_dict_append_basic(dict, "RX.Errors",
-					DBUS_TYPE_UINT32, &stats->rx_errors);
+					DBUS_TYPE_UINT64, &stats->rx_errors);
 	}
 
 	if (counters->tx_errors != stats->tx_errors || append_all) {
 		counters->tx_errors = stats->tx_errors;
 		connman_dbus_dict_append_basic(dict, "TX.Errors",
-					DBUS_TYPE_UINT32, &stats->tx_errors);
+					DBUS_TYPE_UINT64, &stats->tx_errors);
 	}
 
 	if (counters->rx_dropped != stats->rx_dropped || append_all) {
 		counters->rx_dropped = stats->rx_dropped;
 		connman_dbus_dict_append_basic(dict, "RX.Dropped",
-					DBUS_TYPE_UINT32, &stats->rx_dropped);
+					DBUS_TYPE_UINT64, &stats->rx_dropped);
 	}
 
 	if (counters->tx_dropped != stats->tx_dropped || append_all) {
 		counters->tx_dropped = stats->tx_dropped;
 		connman_dbus_dict_append_basic(dict, "TX.Dropped",
-					DBUS_TYPE_UINT32, &stats->tx_dropped);
+					DBUS_TYPE_UINT64, &stats->tx_dropped);
 	}
 
 	if (counters->time != stats->time || append_all) {
@@ -2186,11 +2287,28 @@ static void stats_append(struct connman_service *service,
 	__connman_counter_send_usage(counter, msg);
 }
 
+/*
+ * Growth of a link counter since its last value. The 32-bit counters
+ * of IFLA_STATS wrap around, any other counter that goes backwards
+ * has been reset.
+ */
+static uint64_t stats_delta(uint64_t value, uint64_t last, bool stats32)
+{
+	if (value >= last)
+		return value - last;
+
+	if (stats32)
+		return (uint32_t) (value - last);
+
+	return value;
+}
+
 static void stats_update(struct connman_service *service,
-				unsigned int rx_packets, unsigned int tx_packets,
-				unsigned int rx_bytes, unsigned int tx_bytes,
-				unsigned int rx_errors, unsigned int tx_errors,
-				unsigned int rx_dropped, unsigned int tx_dropped)
+				uint64_t rx_packets, uint64_t tx_packets,
+				uint64_t rx_bytes, uint64_t tx_bytes,
+				uint64_t rx_errors, uint64_t tx_errors,
+				uint64_t rx_dropped, uint64_t tx_dropped,
+				bool stats32)
 {
 	struct connman_stats *stats = stats_get(service);
 	struct connman_stats_data *data_last = &stats->data_last;
@@ -2200,22 +2318,22 @@ static void stats_update(struct connman_service *service,
 	DBG("service %p", service);
 
 	if (stats->valid) {
-		data->rx_packets +=
-			rx_packets - data_last->rx_packets;
-		data->tx_packets +=
-			tx_packets - data_last->tx_packets;
-		data->rx_bytes +=
-			rx_bytes - data_last->rx_bytes;
-		data->tx_bytes +=
-			tx_bytes - data_last->tx_bytes;
-		data->rx_errors +=
-			rx_errors - data_last->rx_errors;
-		data->tx_errors +=
-			tx_errors - data_last->tx_errors;
-		data->rx_dropped +=
-			rx_dropped - data_last->rx_dropped;
-		data->tx_dropped +=
-			tx_dropped - data_last->tx_dropped;
+		data->rx_packets += stats_delta(rx_packets,
+					data_last->rx_packets, stats32);
+		data->tx_packets += stats_delta(tx_packets,
+					data_last->tx_packets, stats32);
+		data->rx_bytes += stats_delta(rx_bytes,
+					data_last->rx_bytes, stats32);
+		data->tx_bytes += stats_delta(tx_bytes,
+					data_last->tx_bytes, stats32);
+		data->rx_errors += stats_delta(rx_errors,
+					data_last->rx_errors, stats32);
+		data->tx_errors += stats_delta(tx_errors,
+					data_last->tx_errors, stats32);
+		data->rx_dropped += stats_delta(rx_dropped,
+					data_last->rx_dropped, stats32);
+		data->tx_dropped += stats_delta(tx_dropped,
+					data_last->tx_dropped, stats32);
 	} else {
 		stats->valid = true;
 	}
@@ -2234,10 +2352,11 @@ static void stats_update(struct connman_service *service,
 }
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_errors, unsigned int tx_errors,
-			unsigned int rx_dropped, unsigned int tx_dropped)
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_errors, uint64_t tx_errors,
+			uint64_t rx_dropped, uint64_t tx_dropped,
+			bool stats32)
 {
 	GHashTableIter iter;
 	gpointer key, value;
@@ -2256,7 +2375,7 @@ void __connman_service_notify(struct connman_service *service,
 		rx_packets, tx_packets,
 		rx_bytes, tx_bytes,
 		rx_errors, tx_errors,
-		rx_dropped, tx_dropped);
+		rx_dropped, tx_dropped, stats32);
 
 	data = &stats_get(service)->data;
 	err = __connman_stats_update(service, service->roaming, data);
@@ -3300,6 +3419,8 @@ int __connman_service_reset_ipconfig(struct connman_service *service,
 	else if (type == CONNMAN_IPCONFIG_TYPE_IPV6)
 		service->ipconfig_ipv6 = new_ipconfig;
 
+	index_hash_reset();
+
 	if (is_connecting(state) || is_connected(state))
 		__connman_ipconfig_enable(new_ipconfig);
 
@@ -3369,7 +3490,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 		if (autoconnect)
 			__connman_service_auto_connect(CONNMAN_SERVICE_CONNECT_REASON_AUTO);
 
-		service_save(service);
+		service_save_now(service);
 	} else if (g_str_equal(name, "Nameservers.Configuration")) {
 		DBusMessageIter entry;
 		GString *str;
@@ -3447,7 +3568,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 			__connman_wispr_start(service,
 						CONNMAN_IPCONFIG_TYPE_IPV6);
 
-		service_save(service);
+		service_save_now(service);
 	} else if (g_str_equal(name, "Timeservers.Configuration")) {
 		DBusMessageIter entry;
 		GString *str;
@@ -3490,7 +3611,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 
 		g_string_free(str, TRUE);
 
-		service_save(service);
+		service_save_now(service);
 		timeservers_configuration_changed(service);
 
 		if (service == __connman_service_get_default())
@@ -3542,7 +3663,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 		domain_configuration_changed(service);
 		domain_changed(service);
 
-		service_save(service);
+		service_save_now(service);
 	} else if (g_str_equal(name, "Proxy.Configuration")) {
 		int err;
 
@@ -3561,7 +3682,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 
 		__connman_notifier_proxy_changed(service);
 
-		service_save(service);
+		service_save_now(service);
 	} else if (g_str_equal(name, "IPv4.Configuration") ||
 			g_str_equal(name, "IPv6.Configuration")) {
 
@@ -3617,7 +3738,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 								service->ipconfig_ipv6);
 		}
 
-		service_save(service);
+		service_save_now(service);
 	} else
 		return __connman_error_invalid_property(msg);
 
@@ -4280,7 +4401,7 @@ bool __connman_service_remove(struct connman_service *service)
 
 	__connman_ipconfig_ipv6_reset_privacy(service->ipconfig_ipv6);
 
-	service_save(service);
+	service_save_now(service);
 
 	return true;
 }
@@ -4366,6 +4487,7 @@ static void switch_default_service(struct connman_service *default_service,
 	service = src->data;
 	service_list = g_list_delete_link(service_list, src);
 	service_list = g_list_insert_before(service_list, dst, service);
+	index_hash_reset();
 
 	downgrade_state(downgrade_service);
 }
@@ -4460,8 +4582,8 @@ static DBusMessage *move_service(DBusConnection *conn,
 	}
 
 	g_get_current_time(&service->modified);
-	service_save(service);
-	service_save(target);
+	service_save_now(service);
+	service_save_now(target);
 
 	/*
 	 * If the service which goes down is the default service and is
@@ -4656,6 +4778,8 @@ static void service_free(gpointer user_data)
 
 	DBG("service %p", service);
 
+	service_save_flush(service);
+
 	reply_pending(service, ENOENT);
 
 	if (service->nameservers_timeout) {
@@ -4669,6 +4793,9 @@ static void service_free(gpointer user_data)
 	__connman_wispr_stop(service);
 	stats_stop(service);
 
+	if (path)
+		g_hash_table_remove(path_hash, path);
+
 	service->path = NULL;
 
 	if (path) {
@@ -4871,12 +4998,58 @@ void connman_service_unref_debug(struct connman_service *service,
 		return;
 
 	service_list = g_list_remove(service_list, service);
+	index_hash_reset();
 
 	__connman_service_disconnect(service);
 
 	g_hash_table_remove(service_hash, service->identifier);
 }
 
+/*
+ * Technologies listed in PreferredTechnologies come first, followed by
+ * the built-in order. The ranks are computed once as the setting does
+ * not change at runtime.
+ */
+static void type_rank_init(void)
+{
+	static const enum connman_service_type builtin[] = {
+		CONNMAN_SERVICE_TYPE_ETHERNET,
+		CONNMAN_SERVICE_TYPE_WIFI,
+		CONNMAN_SERVICE_TYPE_CELLULAR,
+		CONNMAN_SERVICE_TYPE_BLUETOOTH,
+		CONNMAN_SERVICE_TYPE_VPN,
+		CONNMAN_SERVICE_TYPE_GADGET,
+	};
+	unsigned int *tech_array;
+	unsigned int rank = 0;
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(type_rank); i++)
+		type_rank[i] = G_MAXUINT;
+
+	tech_array = connman_setting_get_uint_list("PreferredTechnologies");
+	for (i = 0; tech_array && tech_array[i]; i++) {
+		if (tech_array[i] >= G_N_ELEMENTS(type_rank) ||
+				type_rank[tech_array[i]] != G_MAXUINT)
+			continue;
+
+		type_rank[tech_array[i]] = rank++;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(builtin); i++) {
+		if (type_rank[builtin[i]] == G_MAXUINT)
+			type_rank[builtin[i]] = rank++;
+	}
+}
+
+static unsigned int get_type_rank(enum connman_service_type type)
+{
+	if ((unsigned int) type >= G_N_ELEMENTS(type_rank))
+		return G_MAXUINT;
+
+	return type_rank[type];
+}
+
 static gint service_compare(gconstpointer a, gconstpointer b)
 {
 	struct connman_service *service_a = (void *) a;
@@ -4926,49 +5099,12 @@ static gint service_compare(gconstpointer a, gconstpointer b)
 		return 1;
 
 	if (service_a->type != service_b->type) {
-		unsigned int *tech_array;
-		int i;
-
-		tech_array = connman_setting_get_uint_list(
-						"PreferredTechnologies");
-		if (tech_array) {
-			for (i = 0; tech_array[i]; i++) {
-				if (tech_array[i] == service_a->type)
-					return -1;
-
-				if (tech_array[i] == service_b->type)
-					return 1;
-			}
-		}
+		unsigned int rank_a = get_type_rank(service_a->type);
+		unsigned int rank_b = get_type_rank(service_b->type);
 
-		if (service_a->type == CONNMAN_SERVICE_TYPE_ETHERNET)
+		if (rank_a < rank_b)
 			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_ETHERNET)
-			return 1;
-
-		if (service_a->type == CONNMAN_SERVICE_TYPE_WIFI)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_WIFI)
-			return 1;
-
-		if (service_a->type == CONNMAN_SERVICE_TYPE_CELLULAR)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_CELLULAR)
-			return 1;
-
-		if (service_a->type == CONNMAN_SERVICE_TYPE_BLUETOOTH)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_BLUETOOTH)
-			return 1;
-
-		if (service_a->type == CONNMAN_SERVICE_TYPE_VPN)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_VPN)
-			return 1;
-
-		if (service_a->type == CONNMAN_SERVICE_TYPE_GADGET)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_GADGET)
+		if (rank_a > rank_b)
 			return 1;
 	}
 
@@ -4981,10 +5117,48 @@ static gint service_compare(gconstpointer a, gconstpointer b)
 
 static void service_list_sort(void)
 {
-	if (service_list && service_list->next) {
-		service_list = g_list_sort(service_list, service_compare);
-		service_schedule_changed();
+	GList *list;
+
+	if (!service_list || !service_list->next)
+		return;
+
+	for (list = service_list; list->next; list = list->next) {
+		if (service_compare(list->data, list->next->data) > 0)
+			break;
 	}
+
+	/* Already in order */
+	if (!list->next)
+		return;
+
+	service_list = g_list_sort(service_list, service_compare);
+	index_hash_reset();
+	service_schedule_changed();
+}
+
+/*
+ * Only the sort key of @service changed, so move it to its new place
+ * instead of sorting the whole list.
+ */
+static void service_list_reposition(struct connman_service *service)
+{
+	GList *link;
+
+	link = g_list_find(service_list, service);
+	if (!link)
+		return;
+
+	if ((!link->prev ||
+			service_compare(link->prev->data, service) <= 0) &&
+			(!link->next ||
+			service_compare(service, link->next->data) <= 0))
+		return;
+
+	service_list = g_list_delete_link(service_list, link);
+	service_list = g_list_insert_sorted(service_list, service,
+						service_compare);
+	index_hash_reset();
+	service_schedule_changed();
 }
 
 int __connman_service_compare(const struct connman_service *a,
@@ -5147,7 +5321,7 @@ int __connman_service_set_favorite_delayed(struct connman_service *service,
 
 	if (!delay_ordering) {
 
-		service_list_sort();
+		service_list_reposition(service);
 
 		__connman_connection_update_gateway();
 	}
@@ -5682,7 +5856,7 @@ static int service_indicate_state(struct connman_service *service)
 		break;
 	}
 
-	service_list_sort();
+	service_list_reposition(service);
 
 	__connman_connection_update_gateway();
 
@@ -6485,6 +6659,7 @@ static struct connman_service *service_get(const char *identifier)
 
 	service_list = g_list_insert_sorted(service_list, service,
 						service_compare);
+	index_hash_reset();
 
 	g_hash_table_insert(service_hash, service->identifier, service);
 
@@ -6503,6 +6678,8 @@ static int service_register(struct connman_service *service)
 
 	DBG("path %s", service->path);
 
+	g_hash_table_replace(path_hash, service->path, service);
+
 	if (__connman_config_provision_service(service) < 0)
 		service_load(service);
 
@@ -6511,7 +6688,7 @@ static int service_register(struct connman_service *service)
 					service_methods, service_signals,
 							NULL, service, NULL);
 
-	service_list_sort();
+	service_list_reposition(service);
 
 	__connman_connection_update_gateway();
 
@@ -6644,6 +6821,8 @@ static struct connman_ipconfig *create_ip4config(struct connman_service *service
 	if (!ipconfig_ipv4)
 		return NULL;
 
+	index_hash_reset();
+
 	__connman_ipconfig_set_method(ipconfig_ipv4, method);
 
 	__connman_ipconfig_set_data(ipconfig_ipv4, service);
@@ -6663,6 +6842,8 @@ static struct connman_ipconfig *create_ip6config(struct connman_service *service
 	if (!ipconfig_ipv6)
 		return NULL;
 
+	index_hash_reset();
+
 	__connman_ipconfig_set_data(ipconfig_ipv6, service);
 
 	__connman_ipconfig_set_ops(ipconfig_ipv6, &service_ops);
@@ -6677,6 +6858,8 @@ void __connman_service_read_ip4config(struct connman_service *service)
 	if (!service->ipconfig_ipv4)
 		return;
 
+	service_save_flush(service);
+
 	keyfile = connman_storage_load_service(service->identifier);
 	if (!keyfile)
 		return;
@@ -6707,6 +6890,8 @@ void __connman_service_read_ip6config(struct connman_service *service)
 	if (!service->ipconfig_ipv6)
 		return;
 
+	service_save_flush(service);
+
 	keyfile = connman_storage_load_service(service->identifier);
 	if (!keyfile)
 		return;
@@ -6762,23 +6947,86 @@ struct connman_service *connman_service_lookup_from_network(struct connman_netwo
 }
 
 struct connman_service *__connman_service_lookup_from_index(int index)
+{
+	struct connman_service *service = NULL;
+	gpointer value;
+	GList *list;
+
+	if (!index_hash)
+		return NULL;
+
+	if (g_hash_table_lookup_extended(index_hash, GINT_TO_POINTER(index),
+							NULL, &value))
+		return value;
+
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *iter = list->data;
+
+		if (__connman_ipconfig_get_index(iter->ipconfig_ipv4)
+							== index ||
+				__connman_ipconfig_get_index(
+						iter->ipconfig_ipv6) == index) {
+			service = iter;
+			break;
+		}
+	}
+
+	/* Misses are cached too, most links have no service */
+	g_hash_table_replace(index_hash, GINT_TO_POINTER(index), service);
+
+	return service;
+}
+
+static bool has_counter_interval(struct connman_service *service,
+						unsigned int interval)
+{
+	GHashTableIter iter;
+	gpointer key;
+
+	if (interval == 0)
+		return g_hash_table_size(service->counter_table) > 0;
+
+	g_hash_table_iter_init(&iter, service->counter_table);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		if (__connman_counter_get_interval(key) == interval)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Interfaces of connected services with counters registered at
+ * @interval, or with any counter if @interval is 0; only these need
+ * their link statistics polled.
+ */
+GSList *__connman_service_get_counted_indexes(unsigned int interval)
 {
 	struct connman_service *service;
+	GSList *indexes = NULL;
 	GList *list;
+	int index;
 
 	for (list = service_list; list; list = list->next) {
 		service = list->data;
 
-		if (__connman_ipconfig_get_index(service->ipconfig_ipv4)
-							== index)
-			return service;
+		if (!is_connected(service->state))
+			continue;
 
-		if (__connman_ipconfig_get_index(service->ipconfig_ipv6)
-							== index)
-			return service;
+		if (!has_counter_interval(service, interval))
+			continue;
+
+		index = __connman_ipconfig_get_index(service->ipconfig_ipv4);
+		if (index < 0)
+			index = __connman_ipconfig_get_index(
+						service->ipconfig_ipv6);
+		if (index < 0)
+			continue;
+
+		indexes = g_slist_prepend(indexes, GINT_TO_POINTER(index));
 	}
 
-	return NULL;
+	return indexes;
 }
 
 struct connman_service *__connman_service_lookup_from_ident(const char *identifier)
@@ -6813,19 +7061,19 @@ unsigned int __connman_service_get_order(struct connman_service *service)
 	if (!service)
 		return 0;
 
-	service->order = 0;
-
-	if (!service->favorite)
+	if (!service->favorite) {
+		set_order(service, 0);
 		return 0;
+	}
 
 	if (service == service_list->data)
 		order = 1;
 
 	if (service->type == CONNMAN_SERVICE_TYPE_VPN &&
-			!service->do_split_routing) {
-		service->order = 10;
+			!service->do_split_routing)
 		order = 10;
-	}
+
+	set_order(service, order == 10 ? 10 : 0);
 
 	DBG("service %p name %s order %d split %d", service, service->name,
 		order, service->do_split_routing);
@@ -6929,7 +7177,7 @@ static void update_from_network(struct connman_service *service,
 	if (!service->network)
 		service->network = connman_network_ref(network);
 
-	service_list_sort();
+	service_list_reposition(service);
 }
 
 /**
@@ -7115,7 +7363,7 @@ roaming:
 
 sorting:
 	if (need_sort) {
-		service_list_sort();
+		service_list_reposition(service);
 	}
 }
 
@@ -7312,14 +7560,20 @@ int __connman_service_init(void)
 
 	connection = connman_dbus_get_connection();
 
+	type_rank_init();
+
 	service_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 							NULL, service_free);
+	path_hash = g_hash_table_new(g_str_hash, g_str_equal);
+	index_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	services_notify = g_new0(struct _services_notify, 1);
 	services_notify->remove = g_hash_table_new_full(g_str_hash,
 			g_str_equal, g_free, NULL);
 	services_notify->add = g_hash_table_new(g_str_hash, g_str_equal);
 
+	save_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
 	remove_unprovisioned_services();
 
 	return 0;
@@ -7341,12 +7595,26 @@ void __connman_service_cleanup(void)
 
 	connman_agent_driver_unregister(&agent_driver);
 
+	if (save_timeout) {
+		g_source_remove(save_timeout);
+		save_timeout_cb(NULL);
+	}
+
 	g_list_free(service_list);
 	service_list = NULL;
 
 	g_hash_table_destroy(service_hash);
 	service_hash = NULL;
 
+	g_hash_table_destroy(path_hash);
+	path_hash = NULL;
+
+	g_hash_table_destroy(index_hash);
+	index_hash = NULL;
+
+	g_hash_table_destroy(save_table);
+	save_table = NULL;
+
 	g_slist_free(counter_list);
 	counter_list = NULL;
 
@@ -25,6 +25,7 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <stdio.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -46,7 +47,8 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC 0xFA01B916
+#define MAGIC_V1 0xFA00B916
 
 /*
  * Statistics counters are stored into a ring buffer which is stored
@@ -83,6 +85,10 @@
  *   Same format as the ring buffer file
  *   For a period of at least 2 months dayly records are keept
  *   If older, then only a monthly record is keept
+ *
+ * Version 1 files:
+ *   Identified by MAGIC_V1, the counters in the entries are 32-bit
+ *   They are converted to the current format when opened
  */
 
 
@@ -100,6 +106,24 @@ struct stats_record {
 	struct connman_stats_data data;
 };
 
+struct stats_data_v1 {
+	unsigned int rx_packets;
+	unsigned int tx_packets;
+	unsigned int rx_bytes;
+	unsigned int tx_bytes;
+	unsigned int rx_errors;
+	unsigned int tx_errors;
+	unsigned int rx_dropped;
+	unsigned int tx_dropped;
+	unsigned int time;
+};
+
+struct stats_record_v1 {
+	time_t ts;
+	unsigned int roaming;
+	struct stats_data_v1 data;
+};
+
 struct stats_file {
 	int fd;
 	char *name;
@@ -359,6 +383,162 @@ static int stats_open_temp(struct stats_file *file)
 	return 0;
 }
 
+static int append_record(struct stats_file *file,
+				struct stats_record *rec)
+{
+	struct stats_record *cur, *next;
+	int err;
+
+	if (file->last == get_end(file)) {
+		err = stats_file_remap(file, file->len +
+					sysconf(_SC_PAGESIZE));
+		if (err < 0)
+			return err;
+
+		stats_file_update_cache(file);
+	}
+
+	cur = get_end(file);
+	next = get_next(file, cur);
+
+	memcpy(next, rec, sizeof(struct stats_record));
+
+	set_end(file, next);
+
+	return 0;
+}
+
+static bool stats_v1_offset_valid(unsigned int off, size_t len)
+{
+	size_t hdr_len = sizeof(struct stats_file_header);
+
+	if (off < hdr_len || off + sizeof(struct stats_record_v1) > len)
+		return false;
+
+	return (off - hdr_len) % sizeof(struct stats_record_v1) == 0;
+}
+
+/*
+ * Convert a version 1 file by copying its records into a temporary
+ * file, which then replaces it. The oldest records are dropped if
+ * they do not fit in max_len in the current format.
+ */
+static int stats_file_migrate(struct stats_file *file)
+{
+	struct stats_file _temp_file, *temp_file = &_temp_file;
+	struct stats_file_header *hdr, *old_hdr;
+	struct stats_record_v1 *first, *last, *it, *end;
+	struct stats_record rec;
+	unsigned int off, count, max_count;
+	int err;
+
+	DBG("file %p name %s", file, file->name);
+
+	old_hdr = get_hdr(file);
+
+	if (!stats_v1_offset_valid(old_hdr->begin, file->len) ||
+			!stats_v1_offset_valid(old_hdr->end, file->len)) {
+		connman_warn("Dropping invalid statistics in %s", file->name);
+		return -EINVAL;
+	}
+
+	first = (struct stats_record_v1 *)
+			(file->addr + sizeof(struct stats_file_header));
+	last = first + (file->len - sizeof(struct stats_file_header)) /
+			sizeof(struct stats_record_v1) - 1;
+	it = (struct stats_record_v1 *)(file->addr + old_hdr->begin);
+	end = (struct stats_record_v1 *)(file->addr + old_hdr->end);
+
+	count = (end - it + (last - first + 1)) % (last - first + 1);
+
+	/* the ring keeps one entry free to tell full from empty */
+	max_count = (file->max_len - sizeof(struct stats_file_header)) /
+			sizeof(struct stats_record) - 1;
+
+	bzero(temp_file, sizeof(struct stats_file));
+	temp_file->fd = -1;
+
+	err = stats_open_temp(temp_file);
+	if (err < 0)
+		return err;
+
+	err = stats_file_remap(temp_file, sysconf(_SC_PAGESIZE));
+	if (err < 0)
+		goto error;
+
+	hdr = get_hdr(temp_file);
+	hdr->magic = MAGIC;
+	hdr->begin = sizeof(struct stats_file_header);
+	hdr->end = sizeof(struct stats_file_header);
+	hdr->home = UINT_MAX;
+	hdr->roaming = UINT_MAX;
+
+	stats_file_update_cache(temp_file);
+
+	for (; it != end; count--) {
+		it++;
+		if (it > last)
+			it = first;
+
+		if (count > max_count)
+			continue;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.ts = it->ts;
+		rec.roaming = it->roaming;
+		rec.data.rx_packets = it->data.rx_packets;
+		rec.data.tx_packets = it->data.tx_packets;
+		rec.data.rx_bytes = it->data.rx_bytes;
+		rec.data.tx_bytes = it->data.tx_bytes;
+		rec.data.rx_errors = it->data.rx_errors;
+		rec.data.tx_errors = it->data.tx_errors;
+		rec.data.rx_dropped = it->data.rx_dropped;
+		rec.data.tx_dropped = it->data.tx_dropped;
+		rec.data.time = it->data.time;
+
+		err = append_record(temp_file, &rec);
+		if (err < 0)
+			goto error;
+
+		off = (char *)it - file->addr;
+		if (off == old_hdr->home)
+			set_home(temp_file, get_end(temp_file));
+		if (off == old_hdr->roaming)
+			set_roaming(temp_file, get_end(temp_file));
+	}
+
+	msync(temp_file->addr, temp_file->len, MS_SYNC);
+
+	if (rename(temp_file->name, file->name) < 0) {
+		err = -errno;
+		connman_error("rename error %s for %s",
+				strerror(errno), file->name);
+		goto error;
+	}
+
+	/* continue with the converted file */
+	munmap(file->addr, file->len);
+	close(file->fd);
+
+	file->fd = temp_file->fd;
+	file->addr = temp_file->addr;
+	file->len = temp_file->len;
+	g_free(temp_file->name);
+
+	stats_file_update_cache(file);
+
+	return 0;
+
+error:
+	if (temp_file->addr)
+		munmap(temp_file->addr, temp_file->len);
+	close(temp_file->fd);
+	unlink(temp_file->name);
+	g_free(temp_file->name);
+
+	return err;
+}
+
 static int stats_file_setup(struct stats_file *file)
 {
 	struct stats_file_header *hdr;
@@ -399,6 +579,16 @@ static int stats_file_setup(struct stats_file *file)
 
 	hdr = get_hdr(file);
 
+	if (hdr->magic == MAGIC_V1) {
+		err = stats_file_migrate(file);
+		if (err < 0)
+			connman_warn("Failed to convert statistics in %s",
+					file->name);
+
+		/* the file may have been remapped */
+		hdr = get_hdr(file);
+	}
+
 	if (hdr->magic != MAGIC ||
 			hdr->begin < sizeof(struct stats_file_header) ||
 			hdr->end < sizeof(struct stats_file_header) ||
@@ -433,31 +623,6 @@ static struct stats_record *get_next_record(struct stats_iter *iter)
 	return NULL;
 }
 
-static int append_record(struct stats_file *file,
-				struct stats_record *rec)
-{
-	struct stats_record *cur, *next;
-	int err;
-
-	if (file->last == get_end(file)) {
-		err = stats_file_remap(file, file->len +
-					sysconf(_SC_PAGESIZE));
-		if (err < 0)
-			return err;
-
-		stats_file_update_cache(file);
-	}
-
-	cur = get_end(file);
-	next = get_next(file, cur);
-
-	memcpy(next, rec, sizeof(struct stats_record));
-
-	set_end(file, next);
-
-	return 0;
-}
-
 static struct stats_record *process_file(struct stats_iter *iter,
 					struct stats_file *temp_file,
 					struct stats_record *cur,
@@ -34,6 +34,7 @@
 
 #define SETTINGS	"settings"
 #define DEFAULT		"default.profile"
+#define INDEX		"services.index"
 
 #define MODE		(S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | \
 			S_IXGRP | S_IROTH | S_IXOTH)
@@ -84,6 +85,235 @@ static void storage_delete(const char *pathname)
 		connman_error("Failed to remove %s", pathname);
 }
 
+/*
+ * The service index keeps the keys needed to pick services without
+ * loading them (name, SSID, frequency, flags and last use) for every
+ * service with a settings file. It is stored in a single keyfile with
+ * one group per service and is only a cache of the per-service
+ * settings, which stay authoritative.
+ */
+static GHashTable *index_table = NULL;
+static guint index_save_id = 0;
+
+static void free_entry(gpointer data)
+{
+	struct connman_storage_entry *entry = data;
+
+	g_free(entry->identifier);
+	g_free(entry->name);
+	g_free(entry->ssid);
+	g_free(entry);
+}
+
+/* Returns true if the entry of the service is new or has changed */
+static bool index_update(GKeyFile *keyfile, const char *group,
+						const char *service_id)
+{
+	struct connman_storage_entry *entry, old;
+	bool changed = false;
+	gchar *str;
+
+	entry = g_hash_table_lookup(index_table, service_id);
+	if (!entry) {
+		entry = g_new0(struct connman_storage_entry, 1);
+		entry->identifier = g_strdup(service_id);
+		g_hash_table_replace(index_table, entry->identifier, entry);
+		changed = true;
+	}
+
+	old = *entry;
+
+	entry->name = g_key_file_get_string(keyfile, group, "Name", NULL);
+	entry->ssid = g_key_file_get_string(keyfile, group, "SSID", NULL);
+	entry->frequency = g_key_file_get_integer(keyfile, group,
+							"Frequency", NULL);
+	entry->favorite = g_key_file_get_boolean(keyfile, group,
+							"Favorite", NULL);
+	entry->autoconnect = g_key_file_get_boolean(keyfile, group,
+							"AutoConnect", NULL);
+	entry->hidden = g_key_file_get_boolean(keyfile, group,
+							"Hidden", NULL);
+
+	entry->modified.tv_sec = 0;
+	entry->modified.tv_usec = 0;
+
+	str = g_key_file_get_string(keyfile, group, "Modified", NULL);
+	if (str)
+		g_time_val_from_iso8601(str, &entry->modified);
+	g_free(str);
+
+	if (g_strcmp0(entry->name, old.name) != 0 ||
+			g_strcmp0(entry->ssid, old.ssid) != 0 ||
+			entry->frequency != old.frequency ||
+			entry->favorite != old.favorite ||
+			entry->autoconnect != old.autoconnect ||
+			entry->hidden != old.hidden ||
+			entry->modified.tv_sec != old.modified.tv_sec ||
+			entry->modified.tv_usec != old.modified.tv_usec)
+		changed = true;
+
+	g_free(old.name);
+	g_free(old.ssid);
+
+	return changed;
+}
+
+static void index_save(void)
+{
+	struct connman_storage_entry *entry;
+	GHashTableIter iter;
+	GKeyFile *keyfile;
+	gpointer value;
+	gchar *pathname, *str;
+
+	keyfile = g_key_file_new();
+
+	g_hash_table_iter_init(&iter, index_table);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		entry = value;
+
+		if (entry->name)
+			g_key_file_set_string(keyfile, entry->identifier,
+						"Name", entry->name);
+		if (entry->ssid)
+			g_key_file_set_string(keyfile, entry->identifier,
+						"SSID", entry->ssid);
+		if (entry->frequency)
+			g_key_file_set_integer(keyfile, entry->identifier,
+						"Frequency", entry->frequency);
+
+		g_key_file_set_boolean(keyfile, entry->identifier,
+					"Favorite", entry->favorite);
+		g_key_file_set_boolean(keyfile, entry->identifier,
+					"AutoConnect", entry->autoconnect);
+		g_key_file_set_boolean(keyfile, entry->identifier,
+					"Hidden", entry->hidden);
+
+		if (entry->modified.tv_sec == 0)
+			continue;
+
+		str = g_time_val_to_iso8601(&entry->modified);
+		if (str) {
+			g_key_file_set_string(keyfile, entry->identifier,
+							"Modified", str);
+			g_free(str);
+		}
+	}
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, INDEX);
+	storage_save(keyfile, pathname);
+	g_free(pathname);
+
+	g_key_file_free(keyfile);
+}
+
+static gboolean index_save_cb(gpointer user_data)
+{
+	index_save_id = 0;
+
+	index_save();
+
+	return FALSE;
+}
+
+/* Writes of several services in one main loop iteration share a save */
+static void index_schedule_save(void)
+{
+	if (index_save_id)
+		return;
+
+	index_save_id = g_idle_add(index_save_cb, NULL);
+}
+
+static bool is_service_dir(struct dirent *d)
+{
+	if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 ||
+			strncmp(d->d_name, "provider_", 9) == 0)
+		return false;
+
+	return d->d_type == DT_DIR || d->d_type == DT_UNKNOWN;
+}
+
+/*
+ * Load the index and bring it in sync with the service directories:
+ * services missing from the index are imported from their settings
+ * file and entries without a directory are dropped.
+ */
+static void index_load(void)
+{
+	struct connman_storage_entry *entry;
+	GHashTable *dirs;
+	GHashTableIter iter;
+	GKeyFile *keyfile;
+	gpointer value;
+	struct dirent *d;
+	gchar **groups;
+	gchar *pathname, *str;
+	bool changed = false;
+	DIR *dir;
+	int i;
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, INDEX);
+	keyfile = storage_load(pathname);
+	g_free(pathname);
+
+	if (keyfile) {
+		groups = g_key_file_get_groups(keyfile, NULL);
+		for (i = 0; groups && groups[i]; i++)
+			index_update(keyfile, groups[i], groups[i]);
+
+		g_strfreev(groups);
+		g_key_file_free(keyfile);
+	} else {
+		changed = true;
+	}
+
+	dir = opendir(STORAGEDIR);
+	if (!dir)
+		return;
+
+	dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	while ((d = readdir(dir))) {
+		if (!is_service_dir(d))
+			continue;
+
+		str = g_strdup(d->d_name);
+		g_hash_table_replace(dirs, str, str);
+
+		if (g_hash_table_lookup(index_table, d->d_name))
+			continue;
+
+		keyfile = connman_storage_load_service(d->d_name);
+		if (!keyfile)
+			continue;
+
+		DBG("import %s", d->d_name);
+
+		index_update(keyfile, d->d_name, d->d_name);
+		g_key_file_free(keyfile);
+		changed = true;
+	}
+
+	closedir(dir);
+
+	g_hash_table_iter_init(&iter, index_table);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		entry = value;
+
+		if (g_hash_table_lookup(dirs, entry->identifier))
+			continue;
+
+		g_hash_table_iter_remove(&iter);
+		changed = true;
+	}
+
+	g_hash_table_destroy(dirs);
+
+	if (changed)
+		index_save();
+}
+
 GKeyFile *__connman_storage_load_global(void)
 {
 	gchar *pathname;
@@ -183,6 +413,60 @@ GKeyFile *__connman_storage_open_service(const char *service_id)
 	return keyfile;
 }
 
+static gint compare_modified(gconstpointer a, gconstpointer b)
+{
+	const struct connman_storage_entry *entry_a = a;
+	const struct connman_storage_entry *entry_b = b;
+
+	if (entry_a->modified.tv_sec != entry_b->modified.tv_sec)
+		return entry_a->modified.tv_sec > entry_b->modified.tv_sec ?
+									-1 : 1;
+
+	if (entry_a->modified.tv_usec != entry_b->modified.tv_usec)
+		return entry_a->modified.tv_usec > entry_b->modified.tv_usec ?
+									-1 : 1;
+
+	return g_strcmp0(entry_a->identifier, entry_b->identifier);
+}
+
+/**
+ * connman_storage_get_favorites:
+ * @type: service type prefix of the identifier, e.g. "wifi"
+ *
+ * Get the saved favorite services of @type, most recently used first.
+ * The entries belong to the storage and stay valid until the next
+ * service is saved or removed; free only the list with g_list_free().
+ */
+GList *connman_storage_get_favorites(const char *type)
+{
+	struct connman_storage_entry *entry;
+	GHashTableIter iter;
+	GList *list = NULL;
+	gpointer value;
+	size_t len;
+
+	if (!index_table || !type)
+		return NULL;
+
+	len = strlen(type);
+
+	g_hash_table_iter_init(&iter, index_table);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		entry = value;
+
+		if (!entry->favorite)
+			continue;
+
+		if (strncmp(entry->identifier, type, len) != 0 ||
+				entry->identifier[len] != '_')
+			continue;
+
+		list = g_list_prepend(list, entry);
+	}
+
+	return g_list_sort(list, compare_modified);
+}
+
 gchar **connman_storage_get_services(void)
 {
 	struct dirent *d;
@@ -191,7 +475,24 @@ gchar **connman_storage_get_services(void)
 	GString *result;
 	gchar **services = NULL;
 	struct stat buf;
-	int ret;
+	GHashTableIter iter;
+	gpointer key;
+	int ret, i = 0;
+
+	if (index_table) {
+		services = g_new0(gchar *,
+				g_hash_table_size(index_table) + 1);
+
+		g_hash_table_iter_init(&iter, index_table);
+		while (g_hash_table_iter_next(&iter, &key, NULL))
+			services[i++] = g_strdup(key);
+
+		if (i > 0)
+			return services;
+
+		g_free(services);
+		return NULL;
+	}
 
 	dir = opendir(STORAGEDIR);
 	if (!dir)
@@ -282,6 +583,11 @@ int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
 
 	g_free(pathname);
 
+	/* most saves change nothing the index keeps */
+	if (ret == 0 && index_table &&
+			index_update(keyfile, service_id, service_id))
+		index_schedule_save();
+
 	return ret;
 }
 
@@ -325,6 +631,18 @@ static bool remove_dir(const char *service_id)
 	return ret;
 }
 
+bool __connman_storage_service_exists(const char *service_id)
+{
+	gchar *pathname;
+	bool ret;
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, service_id);
+	ret = g_file_test(pathname, G_FILE_TEST_IS_DIR);
+	g_free(pathname);
+
+	return ret;
+}
+
 bool __connman_storage_remove_service(const char *service_id)
 {
 	bool removed;
@@ -334,6 +652,9 @@ bool __connman_storage_remove_service(const char *service_id)
 	if (!removed)
 		return false;
 
+	if (index_table && g_hash_table_remove(index_table, service_id))
+		index_schedule_save();
+
 	/* Remove the statistics file also */
 	removed = remove_file(service_id, "data");
 	if (!removed)
@@ -474,3 +795,28 @@ gchar **__connman_storage_get_providers(void)
 
 	return providers;
 }
+
+int __connman_storage_init(void)
+{
+	DBG("");
+
+	index_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, free_entry);
+
+	index_load();
+
+	return 0;
+}
+
+void __connman_storage_cleanup(void)
+{
+	DBG("");
+
+	if (index_save_id) {
+		g_source_remove(index_save_id);
+		index_save();
+	}
+
+	g_hash_table_destroy(index_table);
+	index_table = NULL;
+}
@@ -0,0 +1,864 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  agent <agent@local>. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Load test for the DNS proxy of connmand.
+ *
+ * Queries are sent to the proxy at a fixed rate over UDP or TCP, and
+ * the throughput and the latency of the replies are measured. With
+ * --stub the tool also acts as the upstream DNS server, answering
+ * every query itself, which gives the ratio of the queries that the
+ * proxy forwards upstream. Retries and prefetches of the proxy count
+ * as upstream queries too, so this is only a bound on its misses.
+ * The stub listens on port 53 of the given address, which has to be
+ * configured as the nameserver of the connected service, e.g.
+ *
+ *   connmanctl config <service> --nameservers 127.0.0.2
+ *   dnsproxy-bench --stub 127.0.0.2 --qps 2000 --distribution zipf
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <glib.h>
+
+#define MAX_STUB_CLIENTS 16
+#define MAX_OUTSTANDING 4096
+#define TCP_BUF_LEN 4096
+
+static gchar *option_server = NULL;
+static gchar *option_stub = NULL;
+static gchar *option_distribution = NULL;
+static gchar *option_domain = NULL;
+static gboolean option_tcp = FALSE;
+static gint option_qps = 1000;
+static gint option_duration = 10;
+static gint option_names = 1000;
+static gdouble option_exponent = 1.0;
+static gint option_ttl = 300;
+static gint option_pid = 0;
+
+static GOptionEntry options[] = {
+	{ "server", 's', 0, G_OPTION_ARG_STRING, &option_server,
+			"Address of the DNS proxy (default 127.0.0.1)",
+			"ADDRESS" },
+	{ "tcp", 't', 0, G_OPTION_ARG_NONE, &option_tcp,
+			"Send the queries over TCP instead of UDP" },
+	{ "qps", 'q', 0, G_OPTION_ARG_INT, &option_qps,
+			"Queries per second, 0 for as fast as possible "
+			"(default 1000)", "NR" },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &option_duration,
+			"Duration of the test in seconds (default 10)",
+			"SECS" },
+	{ "names", 'n', 0, G_OPTION_ARG_INT, &option_names,
+			"Number of different names to query (default 1000)",
+			"NR" },
+	{ "distribution", 'D', 0, G_OPTION_ARG_STRING, &option_distribution,
+			"Distribution of the names: zipf, unique or repeated "
+			"(default zipf)", "NAME" },
+	{ "exponent", 'e', 0, G_OPTION_ARG_DOUBLE, &option_exponent,
+			"Exponent of the zipf distribution (default 1.0)",
+			"S" },
+	{ "domain", 'o', 0, G_OPTION_ARG_STRING, &option_domain,
+			"Domain the queried names are in (default "
+			"bench.test)", "DOMAIN" },
+	{ "stub", 'u', 0, G_OPTION_ARG_STRING, &option_stub,
+			"Answer the forwarded queries on port 53 of ADDRESS",
+			"ADDRESS" },
+	{ "ttl", 'T', 0, G_OPTION_ARG_INT, &option_ttl,
+			"TTL of the answers of the stub (default 300)",
+			"SECS" },
+	{ "pid", 'p', 0, G_OPTION_ARG_INT, &option_pid,
+			"Process id of connmand, for its memory usage",
+			"PID" },
+	{ NULL },
+};
+
+enum distribution {
+	DISTRIBUTION_ZIPF,
+	DISTRIBUTION_UNIQUE,
+	DISTRIBUTION_REPEATED,
+};
+
+struct bench {
+	enum distribution distribution;
+	double *zipf_cdf;
+
+	int sk;
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+
+	/* reassembly of the TCP replies */
+	unsigned char buf[TCP_BUF_LEN];
+	unsigned int buf_end;
+
+	/* TCP queries not yet accepted by the socket */
+	unsigned char out[TCP_BUF_LEN];
+	unsigned int out_end;
+
+	/* send time of the outstanding queries, by query id */
+	uint64_t sent_at[65536];
+
+	unsigned int sent;
+	unsigned int received;
+	unsigned int outstanding;
+	GArray *latencies; /* in microseconds */
+};
+
+struct stub_client {
+	int sk;
+	unsigned char buf[TCP_BUF_LEN];
+	unsigned int buf_end;
+};
+
+struct stub {
+	int udp_sk;
+	int tcp_sk;
+	struct stub_client clients[MAX_STUB_CLIENTS];
+	unsigned int queries;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int parse_address(const char *address, const char *port,
+				int socktype, struct sockaddr_storage *sa,
+				socklen_t *sa_len)
+{
+	struct addrinfo hints, *rp;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+
+	hints.ai_socktype = socktype;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
+
+	err = getaddrinfo(address, port, &hints, &rp);
+	if (err) {
+		fprintf(stderr, "Invalid address %s: %s\n", address,
+						gai_strerror(err));
+		return -EINVAL;
+	}
+
+	memcpy(sa, rp->ai_addr, rp->ai_addrlen);
+	*sa_len = rp->ai_addrlen;
+
+	freeaddrinfo(rp);
+
+	return 0;
+}
+
+static void setup_zipf(struct bench *bench)
+{
+	double sum = 0;
+	int i;
+
+	bench->zipf_cdf = g_new(double, option_names);
+
+	for (i = 0; i < option_names; i++) {
+		sum += 1.0 / pow(i + 1, option_exponent);
+		bench->zipf_cdf[i] = sum;
+	}
+
+	for (i = 0; i < option_names; i++)
+		bench->zipf_cdf[i] /= sum;
+}
+
+static unsigned int pick_name(struct bench *bench)
+{
+	double r;
+	int low, high;
+
+	switch (bench->distribution) {
+	case DISTRIBUTION_UNIQUE:
+		return bench->sent;
+	case DISTRIBUTION_REPEATED:
+		return 0;
+	case DISTRIBUTION_ZIPF:
+		break;
+	}
+
+	r = g_random_double();
+	low = 0;
+	high = option_names - 1;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+
+		if (bench->zipf_cdf[mid] < r)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* Build an A query for n<index>.<domain>, returns its length */
+static int build_query(unsigned char *buf, uint16_t id, unsigned int index)
+{
+	char name[256];
+	unsigned char *ptr = buf + 12;
+	char **labels;
+	int i;
+
+	snprintf(name, sizeof(name), "n%u.%s", index, option_domain);
+
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01; /* recursion desired */
+	buf[5] = 1; /* one question */
+
+	labels = g_strsplit(name, ".", 0);
+	for (i = 0; labels[i]; i++) {
+		size_t len = strlen(labels[i]);
+
+		if (len == 0 || len > 63)
+			continue;
+
+		*ptr++ = len;
+		memcpy(ptr, labels[i], len);
+		ptr += len;
+	}
+	g_strfreev(labels);
+
+	*ptr++ = 0;
+	*ptr++ = 0; *ptr++ = 1; /* type A */
+	*ptr++ = 0; *ptr++ = 1; /* class IN */
+
+	return ptr - buf;
+}
+
+/* Send as much of the queued TCP queries as the socket takes */
+static void flush_queries(struct bench *bench)
+{
+	int err;
+
+	while (bench->out_end > 0) {
+		err = send(bench->sk, bench->out, bench->out_end,
+							MSG_NOSIGNAL);
+		if (err < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+							errno != EINTR)
+				fprintf(stderr, "Cannot send query: %s\n",
+							strerror(errno));
+			return;
+		}
+
+		bench->out_end -= err;
+		memmove(bench->out, bench->out + err, bench->out_end);
+	}
+}
+
+static void send_query(struct bench *bench)
+{
+	unsigned char buf[2 + 512];
+	uint16_t id = bench->sent & 0xffff;
+	int len, err;
+
+	if (option_tcp && bench->out_end + sizeof(buf) > sizeof(bench->out))
+		return;
+
+	len = build_query(buf + 2, id, pick_name(bench));
+
+	if (option_tcp) {
+		/* the socket may take only a part, the rest is sent later */
+		buf[0] = len >> 8;
+		buf[1] = len & 0xff;
+		memcpy(bench->out + bench->out_end, buf, len + 2);
+		bench->out_end += len + 2;
+		flush_queries(bench);
+	} else {
+		err = sendto(bench->sk, buf + 2, len, MSG_NOSIGNAL,
+				(struct sockaddr *) &bench->sa, bench->sa_len);
+		if (err < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				fprintf(stderr, "Cannot send query: %s\n",
+							strerror(errno));
+			return;
+		}
+	}
+
+	/* a query that is still outstanding after 65536 more is lost */
+	if (bench->sent_at[id] == 0)
+		bench->outstanding++;
+
+	bench->sent_at[id] = now_us();
+	bench->sent++;
+}
+
+static void handle_reply(struct bench *bench, const unsigned char *buf,
+								int len)
+{
+	uint32_t latency;
+	uint16_t id;
+
+	if (len < 12)
+		return;
+
+	id = buf[0] << 8 | buf[1];
+	if (bench->sent_at[id] == 0)
+		return;
+
+	latency = now_us() - bench->sent_at[id];
+	g_array_append_val(bench->latencies, latency);
+
+	bench->sent_at[id] = 0;
+	bench->outstanding--;
+	bench->received++;
+}
+
+static void read_replies(struct bench *bench)
+{
+	unsigned char buf[TCP_BUF_LEN];
+	unsigned int len;
+	int ret;
+
+	if (!option_tcp) {
+		while ((ret = recv(bench->sk, buf, sizeof(buf), 0)) > 0)
+			handle_reply(bench, buf, ret);
+		return;
+	}
+
+	ret = recv(bench->sk, bench->buf + bench->buf_end,
+			sizeof(bench->buf) - bench->buf_end, 0);
+	if (ret == 0) {
+		fprintf(stderr, "Connection closed by the DNS proxy\n");
+		close(bench->sk);
+		bench->sk = -1;
+		return;
+	}
+
+	if (ret < 0)
+		return;
+
+	bench->buf_end += ret;
+
+	while (bench->buf_end >= 2) {
+		len = bench->buf[0] << 8 | bench->buf[1];
+		if (bench->buf_end < len + 2)
+			break;
+
+		handle_reply(bench, bench->buf + 2, len);
+
+		bench->buf_end -= len + 2;
+		memmove(bench->buf, bench->buf + len + 2, bench->buf_end);
+	}
+}
+
+static int open_socket(int family, int type)
+{
+	int sk;
+
+	sk = socket(family, type | SOCK_CLOEXEC, 0);
+	if (sk < 0) {
+		fprintf(stderr, "Cannot create socket: %s\n",
+							strerror(errno));
+		return -errno;
+	}
+
+	return sk;
+}
+
+static int bench_connect(struct bench *bench)
+{
+	int type = option_tcp ? SOCK_STREAM : SOCK_DGRAM;
+
+	if (parse_address(option_server, "53", type, &bench->sa,
+							&bench->sa_len) < 0)
+		return -EINVAL;
+
+	bench->sk = open_socket(bench->sa.ss_family, type);
+	if (bench->sk < 0)
+		return bench->sk;
+
+	if (option_tcp && connect(bench->sk, (struct sockaddr *) &bench->sa,
+						bench->sa_len) < 0) {
+		fprintf(stderr, "Cannot connect to %s: %s\n", option_server,
+							strerror(errno));
+		close(bench->sk);
+		return -errno;
+	}
+
+	fcntl(bench->sk, F_SETFL, O_NONBLOCK);
+
+	return 0;
+}
+
+/* Turn a query into an answer with one A record */
+static int stub_answer(unsigned char *buf, int len, int size)
+{
+	unsigned char *ptr;
+	int i;
+
+	if (len < 12 + 5 || len + 16 > size || (buf[2] & 0x80))
+		return -EINVAL;
+
+	/* skip the name of the question and its type and class */
+	for (i = 12; i < len && buf[i]; i += buf[i] + 1)
+		;
+
+	if (i + 5 > len)
+		return -EINVAL;
+
+	len = i + 5;
+
+	buf[2] |= 0x80; /* response */
+	buf[3] = 0x80; /* recursion available, no error */
+	buf[6] = 0; buf[7] = 1; /* one answer */
+	memset(buf + 8, 0, 4);
+
+	ptr = buf + len;
+	*ptr++ = 0xc0; *ptr++ = 12; /* the name of the question */
+	*ptr++ = 0; *ptr++ = 1; /* type A */
+	*ptr++ = 0; *ptr++ = 1; /* class IN */
+	*ptr++ = option_ttl >> 24;
+	*ptr++ = option_ttl >> 16;
+	*ptr++ = option_ttl >> 8;
+	*ptr++ = option_ttl;
+	*ptr++ = 0; *ptr++ = 4;
+	*ptr++ = 192; *ptr++ = 0; *ptr++ = 2; *ptr++ = 1;
+
+	return ptr - buf;
+}
+
+static int stub_setup(struct stub *stub)
+{
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	int i, on = 1;
+
+	for (i = 0; i < MAX_STUB_CLIENTS; i++)
+		stub->clients[i].sk = -1;
+
+	stub->udp_sk = stub->tcp_sk = -1;
+
+	if (!option_stub)
+		return 0;
+
+	if (parse_address(option_stub, "53", SOCK_DGRAM, &sa, &sa_len) < 0)
+		return -EINVAL;
+
+	stub->udp_sk = open_socket(sa.ss_family, SOCK_DGRAM);
+	stub->tcp_sk = open_socket(sa.ss_family, SOCK_STREAM);
+	if (stub->udp_sk < 0 || stub->tcp_sk < 0)
+		return -EIO;
+
+	setsockopt(stub->tcp_sk, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (bind(stub->udp_sk, (struct sockaddr *) &sa, sa_len) < 0 ||
+			bind(stub->tcp_sk, (struct sockaddr *) &sa,
+							sa_len) < 0 ||
+			listen(stub->tcp_sk, 8) < 0) {
+		fprintf(stderr, "Cannot listen on %s port 53: %s\n",
+						option_stub, strerror(errno));
+		return -errno;
+	}
+
+	fcntl(stub->udp_sk, F_SETFL, O_NONBLOCK);
+	fcntl(stub->tcp_sk, F_SETFL, O_NONBLOCK);
+
+	return 0;
+}
+
+static void stub_udp_event(struct stub *stub)
+{
+	unsigned char buf[512];
+	struct sockaddr_storage sa;
+	socklen_t sa_len = sizeof(sa);
+	int len;
+
+	while ((len = recvfrom(stub->udp_sk, buf, sizeof(buf), 0,
+				(struct sockaddr *) &sa, &sa_len)) > 0) {
+		stub->queries++;
+
+		len = stub_answer(buf, len, sizeof(buf));
+		if (len > 0)
+			sendto(stub->udp_sk, buf, len, MSG_NOSIGNAL,
+					(struct sockaddr *) &sa, sa_len);
+
+		sa_len = sizeof(sa);
+	}
+}
+
+static void stub_accept(struct stub *stub)
+{
+	int i, sk;
+
+	sk = accept(stub->tcp_sk, NULL, NULL);
+	if (sk < 0)
+		return;
+
+	for (i = 0; i < MAX_STUB_CLIENTS; i++) {
+		if (stub->clients[i].sk < 0) {
+			fcntl(sk, F_SETFL, O_NONBLOCK);
+			stub->clients[i].sk = sk;
+			stub->clients[i].buf_end = 0;
+			return;
+		}
+	}
+
+	close(sk);
+}
+
+static void stub_tcp_event(struct stub *stub, struct stub_client *client)
+{
+	unsigned char reply[2 + 512];
+	unsigned int len;
+	int ret;
+
+	ret = recv(client->sk, client->buf + client->buf_end,
+			sizeof(client->buf) - client->buf_end, 0);
+	if (ret <= 0) {
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		close(client->sk);
+		client->sk = -1;
+		return;
+	}
+
+	client->buf_end += ret;
+
+	while (client->buf_end >= 2) {
+		len = client->buf[0] << 8 | client->buf[1];
+		if (client->buf_end < len + 2)
+			break;
+
+		stub->queries++;
+
+		if (len <= sizeof(reply) - 2) {
+			memcpy(reply + 2, client->buf + 2, len);
+
+			ret = stub_answer(reply + 2, len, sizeof(reply) - 2);
+			if (ret > 0) {
+				reply[0] = ret >> 8;
+				reply[1] = ret & 0xff;
+				send(client->sk, reply, ret + 2,
+							MSG_NOSIGNAL);
+			}
+		}
+
+		client->buf_end -= len + 2;
+		memmove(client->buf, client->buf + len + 2, client->buf_end);
+	}
+}
+
+static pid_t find_connmand(void)
+{
+	struct dirent *d;
+	pid_t pid = 0;
+	DIR *dir;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return 0;
+
+	while (!pid && (d = readdir(dir))) {
+		char *path, *comm = NULL;
+
+		if (!g_ascii_isdigit(d->d_name[0]))
+			continue;
+
+		path = g_strdup_printf("/proc/%s/comm", d->d_name);
+		if (g_file_get_contents(path, &comm, NULL, NULL) &&
+				g_str_equal(g_strstrip(comm), "connmand"))
+			pid = atoi(d->d_name);
+
+		g_free(comm);
+		g_free(path);
+	}
+
+	closedir(dir);
+
+	return pid;
+}
+
+/* Resident memory of the process in kB, 0 if unknown */
+static unsigned long get_rss(pid_t pid)
+{
+	unsigned long rss = 0;
+	char *path, *status, *line;
+
+	if (pid <= 0)
+		return 0;
+
+	path = g_strdup_printf("/proc/%d/status", pid);
+
+	if (g_file_get_contents(path, &status, NULL, NULL)) {
+		line = strstr(status, "VmRSS:");
+		if (line)
+			rss = strtoul(line + 6, NULL, 10);
+		g_free(status);
+	}
+
+	g_free(path);
+
+	return rss;
+}
+
+static int compare_latency(gconstpointer a, gconstpointer b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(GArray *latencies, unsigned int percent)
+{
+	unsigned int index;
+
+	if (latencies->len == 0)
+		return 0;
+
+	index = (latencies->len - 1) * percent / 100;
+
+	return g_array_index(latencies, uint32_t, index) / 1000.0;
+}
+
+static void run(struct bench *bench, struct stub *stub)
+{
+	struct pollfd fds[3 + MAX_STUB_CLIENTS];
+	struct stub_client *clients[3 + MAX_STUB_CLIENTS];
+	uint64_t start, now, end, drain;
+	int i, nfds, timeout;
+
+	start = now_us();
+	end = start + (uint64_t) option_duration * 1000000;
+	drain = end + 2000000;
+
+	while (bench->sk >= 0) {
+		now = now_us();
+
+		if (now >= end && (bench->outstanding == 0 || now >= drain))
+			break;
+
+		/* send the queries that are due by now */
+		while (now < end && bench->outstanding < MAX_OUTSTANDING &&
+				(option_qps == 0 ||
+				bench->sent < (now - start) *
+					option_qps / 1000000 + 1)) {
+			unsigned int sent = bench->sent;
+
+			send_query(bench);
+			if (bench->sent == sent || option_qps == 0)
+				break;
+		}
+
+		nfds = 0;
+
+		fds[nfds].fd = bench->sk;
+		fds[nfds].events = bench->out_end > 0 ?
+					POLLIN | POLLOUT : POLLIN;
+		clients[nfds++] = NULL;
+
+		if (stub->udp_sk >= 0) {
+			fds[nfds].fd = stub->udp_sk;
+			fds[nfds].events = POLLIN;
+			clients[nfds++] = NULL;
+
+			fds[nfds].fd = stub->tcp_sk;
+			fds[nfds].events = POLLIN;
+			clients[nfds++] = NULL;
+		}
+
+		for (i = 0; i < MAX_STUB_CLIENTS; i++) {
+			if (stub->clients[i].sk < 0)
+				continue;
+
+			fds[nfds].fd = stub->clients[i].sk;
+			fds[nfds].events = POLLIN;
+			clients[nfds++] = &stub->clients[i];
+		}
+
+		timeout = option_qps > 0 && now < end ?
+				1000 / option_qps : 10;
+		if (option_qps == 0 && now < end)
+			timeout = 0;
+
+		if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		if (fds[0].revents & POLLOUT)
+			flush_queries(bench);
+
+		for (i = 0; i < nfds; i++) {
+			if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			if (clients[i])
+				stub_tcp_event(stub, clients[i]);
+			else if (fds[i].fd == bench->sk)
+				read_replies(bench);
+			else if (fds[i].fd == stub->udp_sk)
+				stub_udp_event(stub);
+			else if (fds[i].fd == stub->tcp_sk)
+				stub_accept(stub);
+		}
+	}
+}
+
+static void report(struct bench *bench, struct stub *stub, double secs,
+				unsigned long rss_before,
+				unsigned long rss_after)
+{
+	g_array_sort(bench->latencies, compare_latency);
+
+	printf("queries sent      %u\n", bench->sent);
+	printf("replies received  %u (%u lost)\n", bench->received,
+					bench->sent - bench->received);
+	printf("throughput        %.1f replies/s\n",
+					secs > 0 ? bench->received / secs : 0);
+	printf("latency p50       %.3f ms\n",
+					percentile(bench->latencies, 50));
+	printf("latency p99       %.3f ms\n",
+					percentile(bench->latencies, 99));
+
+	/* includes the retries and prefetches of the proxy */
+	if (stub->udp_sk >= 0 && bench->sent > 0)
+		printf("upstream queries  %u (%.1f %% of the queries)\n",
+			stub->queries, 100.0 * stub->queries / bench->sent);
+	else
+		printf("upstream queries  unknown, use --stub\n");
+
+	if (rss_before > 0)
+		printf("connmand RSS      %lu kB before, %lu kB after\n",
+						rss_before, rss_after);
+	else
+		printf("connmand RSS      unknown, use --pid\n");
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct bench *bench;
+	struct stub stub;
+	unsigned long rss_before;
+	uint64_t start;
+	pid_t pid;
+	int i;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		if (error) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if (!option_server)
+		option_server = g_strdup("127.0.0.1");
+
+	if (!option_domain)
+		option_domain = g_strdup("bench.test");
+
+	if (option_qps < 0 || option_duration <= 0 || option_names <= 0) {
+		g_printerr("Invalid rate, duration or number of names\n");
+		return 1;
+	}
+
+	bench = g_new0(struct bench, 1);
+	bench->latencies = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+
+	if (!option_distribution ||
+			g_str_equal(option_distribution, "zipf")) {
+		bench->distribution = DISTRIBUTION_ZIPF;
+		setup_zipf(bench);
+	} else if (g_str_equal(option_distribution, "unique"))
+		bench->distribution = DISTRIBUTION_UNIQUE;
+	else if (g_str_equal(option_distribution, "repeated"))
+		bench->distribution = DISTRIBUTION_REPEATED;
+	else {
+		g_printerr("Unknown distribution %s\n", option_distribution);
+		return 1;
+	}
+
+	if (stub_setup(&stub) < 0 || bench_connect(bench) < 0)
+		return 1;
+
+	pid = option_pid > 0 ? option_pid : find_connmand();
+	rss_before = get_rss(pid);
+
+	start = now_us();
+
+	run(bench, &stub);
+
+	report(bench, &stub, (now_us() - start) / 1000000.0,
+					rss_before, get_rss(pid));
+
+	if (bench->sk >= 0)
+		close(bench->sk);
+
+	for (i = 0; i < MAX_STUB_CLIENTS; i++) {
+		if (stub.clients[i].sk >= 0)
+			close(stub.clients[i].sk);
+	}
+
+	if (stub.udp_sk >= 0)
+		close(stub.udp_sk);
+
+	if (stub.tcp_sk >= 0)
+		close(stub.tcp_sk);
+
+	g_array_free(bench->latencies, TRUE);
+	g_free(bench->zipf_cdf);
+	g_free(bench);
+
+	g_free(option_server);
+	g_free(option_stub);
+	g_free(option_distribution);
+	g_free(option_domain);
+
+	return 0;
+}